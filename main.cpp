@@ -1,11 +1,33 @@
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <csignal>
+#include <cstdio>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <sstream>
 #include <iostream>
 #include <thread>
+#include <type_traits>
 #ifdef _WIN32
+#define NOMINMAX
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 void enableAnsiColors() {
@@ -44,17 +66,81 @@ int OS() {
 #endif
 }
 
-int rng(int range)
-{
-    std::random_device device;
-    std::mt19937 generator(device());
-    std::uniform_int_distribution<int> distribution( 0, range - 1 );
-    return (distribution(generator));
-}
-int rollDie(int sides = 6)
+// xoshiro256** seeded through splitmix64. Small and fast, the same seed
+// always gives the same sequence, so a game can be replayed from its seed.
+class Rng
 {
-    return rng(sides) + 1;
-}
+public:
+    Rng(uint64_t seed = 0)
+    {
+        Seed(seed);
+    }
+    void Seed(uint64_t seed)
+    {
+        this->seed = seed;
+        for(auto &word : state)
+        {
+            seed += 0x9e3779b97f4a7c15ull;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            word = z ^ (z >> 31);
+        }
+    }
+    uint64_t GetSeed() const
+    {
+        return seed;
+    }
+    uint64_t Next()
+    {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+    // uniform in [0, range)
+    int Below(int range)
+    {
+        return Below32(uint32_t(Next()), range);
+    }
+    // count dice at once, two dice per generator step
+    void RollDice(int* dice, int count, int sides = 6)
+    {
+        for(int i = 0; i < count; i += 2)
+        {
+            uint64_t bits = Next();
+            dice[i] = Below32(uint32_t(bits), sides) + 1;
+            if(i + 1 < count)
+                dice[i + 1] = Below32(uint32_t(bits >> 32), sides) + 1;
+        }
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+    // Lemire's multiply-shift with rejection, no modulo bias
+    int Below32(uint32_t bits, int range)
+    {
+        uint64_t m = uint64_t(bits) * uint32_t(range);
+        if(uint32_t(m) < uint32_t(range))
+        {
+            uint32_t threshold = uint32_t(-uint32_t(range)) % uint32_t(range);
+            while(uint32_t(m) < threshold)
+                m = uint64_t(uint32_t(Next())) * uint32_t(range);
+        }
+        return int(m >> 32);
+    }
+
+    uint64_t seed;
+    uint64_t state[4];
+};
 
 enum class colorCode
 {
@@ -69,42 +155,679 @@ enum class colorCode
     normal = 9
 };
 
+// Hot path instrumentation, built with ONECARD_PROFILE only: scoped
+// timers and counters go to per-thread data (one writer each, so plain
+// relaxed loads and stores), merged and printed to stderr at exit or on
+// SIGUSR1 at the next turn. Without the flag the macros are empty.
+#ifdef ONECARD_PROFILE
+enum class probe { heroTurn, enemiesTurn, monsterMove, lineOfSight, render };
+const int PROBES = 5;
+const char* const probeNames[PROBES] = {"Level::HeroTurn", "Level::EnemiesTurn",
+                                        "Enemies::Move", "lineOfSight", "Renderer::Draw"};
+enum class counter { losQueries, pathSteps, monsterDontKnow, allocations, terminalBytes };
+const int COUNTERS = 5;
+const char* const counterNames[COUNTERS] = {"line of sight queries", "path steps",
+                                            "Monster don't know", "allocations",
+                                            "terminal bytes"};
+
+// HDR style: exact below 16, then 16 buckets per power of two, so any
+// value is kept within 1/16 of itself
+class LatencyHistogram
+{
+public:
+    static const int SUB = 16;
+    static const int BUCKETS = 61 * SUB;
+
+    void Record(uint64_t value)
+    {
+        std::atomic<uint64_t>& bucket = counts[Bucket(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total.store(total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        if(value > max.load(std::memory_order_relaxed))
+            max.store(value, std::memory_order_relaxed);
+    }
+    void Add(const LatencyHistogram& other)
+    {
+        for(int b = 0; b < BUCKETS; b++)
+            counts[b] += other.counts[b].load(std::memory_order_relaxed);
+        total += other.total.load(std::memory_order_relaxed);
+        max = std::max(max.load(), other.max.load(std::memory_order_relaxed));
+    }
+    uint64_t Count() const
+    {
+        uint64_t count = 0;
+        for(const auto& bucket : counts)
+            count += bucket;
+        return count;
+    }
+    uint64_t Total() const
+    {
+        return total;
+    }
+    uint64_t Max() const
+    {
+        return max;
+    }
+    // lower bound of the bucket holding the given fraction of the values
+    uint64_t Percentile(double fraction) const
+    {
+        uint64_t rank = uint64_t(fraction * Count()), seen = 0;
+        for(int b = 0; b < BUCKETS; b++)
+        {
+            seen += counts[b];
+            if(seen > rank)
+                return Lower(b);
+        }
+        return max;
+    }
+
+private:
+    static int Bucket(uint64_t value)
+    {
+        if(value < SUB)
+            return int(value);
+#ifdef _MSC_VER
+        unsigned long top;
+        _BitScanReverse64(&top, value);
+        int shift = int(top) - 4;
+#else
+        int shift = 59 - __builtin_clzll(value);
+#endif
+        return (shift + 1) * SUB + int((value >> shift) & (SUB - 1));
+    }
+    static uint64_t Lower(int bucket)
+    {
+        if(bucket < SUB)
+            return bucket;
+        return uint64_t(SUB + bucket % SUB) << (bucket / SUB - 1);
+    }
+
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> total{0}, max{0};
+};
+
+struct ProfileData
+{
+    LatencyHistogram timers[PROBES];
+    std::atomic<uint64_t> counters[COUNTERS] = {};
+};
+
+// operator new can run before the thread has its data, so allocations
+// are counted in one shared word
+std::atomic<uint64_t> profileAllocations{0};
+std::atomic<bool> profileDumpRequested{false};
+
+class Profiler
+{
+public:
+    // never destroyed, the data outlives every thread and the exit dump
+    static Profiler& Get()
+    {
+        static Profiler* profiler = new Profiler;
+        return *profiler;
+    }
+    // this thread's data, registered on first use
+    ProfileData& Local()
+    {
+        thread_local ProfileData* data = Register();
+        return *data;
+    }
+    void Dump(std::ostream& out)
+    {
+        ProfileData sum;
+        size_t count;
+        {
+            std::lock_guard<std::mutex> lock(guard);
+            count = threads.size();
+            for(const ProfileData* data : threads)
+            {
+                for(int p = 0; p < PROBES; p++)
+                    sum.timers[p].Add(data->timers[p]);
+                for(int c = 0; c < COUNTERS; c++)
+                    sum.counters[c] += data->counters[c].load(std::memory_order_relaxed);
+            }
+        }
+        sum.counters[int(counter::allocations)] = profileAllocations.load();
+        out << "profile, threads: " << count << "\n";
+        out << "timer\tcount\ttotal ms\tmean ns\tp50\tp90\tp99\tmax\n";
+        for(int p = 0; p < PROBES; p++)
+        {
+            const LatencyHistogram& timer = sum.timers[p];
+            uint64_t n = timer.Count();
+            if(!n)
+                continue;
+            out << probeNames[p] << '\t' << n << '\t' << timer.Total() / 1e6 << '\t'
+                << timer.Total() / n << '\t' << timer.Percentile(0.5) << '\t'
+                << timer.Percentile(0.9) << '\t' << timer.Percentile(0.99) << '\t'
+                << timer.Max() << "\n";
+        }
+        for(int c = 0; c < COUNTERS; c++)
+            out << counterNames[c] << '\t' << sum.counters[c] << "\n";
+    }
+
+private:
+    ProfileData* Register()
+    {
+        ProfileData* data = new ProfileData;
+        std::lock_guard<std::mutex> lock(guard);
+        threads.push_back(data);
+        return data;
+    }
+
+    std::mutex guard;
+    std::vector<ProfileData*> threads;
+};
+
+class ProfileScope
+{
+public:
+    ProfileScope(probe p)
+        :timer(Profiler::Get().Local().timers[int(p)]), start(std::chrono::steady_clock::now())
+    {
+    }
+    ~ProfileScope()
+    {
+        timer.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    LatencyHistogram& timer;
+    std::chrono::steady_clock::time_point start;
+};
+
+inline void profileCount(counter c, uint64_t n)
+{
+    if(c == counter::allocations)
+    {
+        profileAllocations.fetch_add(n, std::memory_order_relaxed);
+        return;
+    }
+    std::atomic<uint64_t>& value = Profiler::Get().Local().counters[int(c)];
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+// dumps if a signal asked for it since the last call
+inline void profilePoll()
+{
+    if(profileDumpRequested.load(std::memory_order_relaxed) && profileDumpRequested.exchange(false))
+        Profiler::Get().Dump(std::cerr);
+}
+void profileStart()
+{
+    std::atexit([] { Profiler::Get().Dump(std::cerr); });
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, [](int) { profileDumpRequested = true; });
+#endif
+}
+
+// counts every allocation; new and delete stay malloc and free
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(std::size_t size)
+{
+    profileAllocations.fetch_add(1, std::memory_order_relaxed);
+    if(void* memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#define PROFILE_JOIN(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_JOIN(profileScope, line)
+#define PROFILE_SCOPE(p) ProfileScope PROFILE_NAME(__LINE__)(probe::p)
+#define PROFILE_COUNT(c, n) profileCount(counter::c, n)
+#define PROFILE_POLL() profilePoll()
+#else
+#define PROFILE_SCOPE(p) ((void)0)
+#define PROFILE_COUNT(c, n) ((void)0)
+#define PROFILE_POLL() ((void)0)
+#endif
+
+// Log output is formatted into a reusable frame buffer. A frame ends at
+// every animation pause and goes to a background writer thread, which
+// writes it with one call and then does the pause itself, so the game
+// thread never sleeps. Call Sync() before reading input.
+class LogSink
+{
+public:
+    LogSink(std::ostream& output = std::cout)
+        :out(output), writer(&LogSink::Run, this)
+    {
+    }
+    ~LogSink()
+    {
+        Sync();
+        {
+            std::lock_guard<std::mutex> lock(guard);
+            stop = true;
+        }
+        pending.notify_all();
+        writer.join();
+    }
+
+    void Append(const std::string& text)
+    {
+        frame += text;
+    }
+    void Append(const char* text)
+    {
+        frame += text;
+    }
+    void Append(char c)
+    {
+        frame += c;
+    }
+    void Append(int number)
+    {
+        char digits[16];
+        auto end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+        frame.append(digits, end);
+    }
+    template<class T>
+    void Append(const T& message)
+    {
+        format.str("");
+        format << message;
+        frame += format.str();
+    }
+
+    // ends the frame, the writer waits delayTime ms after writing it
+    void Pause(int delayTime)
+    {
+        EndFrame(delayTime);
+    }
+    // ends the frame and waits until everything is written
+    void Sync()
+    {
+        EndFrame(0);
+        std::unique_lock<std::mutex> lock(guard);
+        idle.wait(lock, [this] { return queue.empty() && !writing; });
+    }
+
+    static const std::string& Font(colorCode color)
+    {
+        static const std::string codes[] = {
+            "\e[30m", "\e[31m", "\e[32m", "\e[33m", "\e[34m",
+            "\e[35m", "\e[36m", "\e[37m", "\e[38m", "\e[39m"};
+        return codes[int(color)];
+    }
+    static const std::string& Background(colorCode color)
+    {
+        static const std::string codes[] = {
+            "\e[100m", "\e[101m", "\e[102m", "\e[103m", "\e[104m",
+            "\e[105m", "\e[106m", "\e[107m", "\e[108m", "\e[109m"};
+        return codes[int(color)];
+    }
+
+private:
+    struct Chunk
+    {
+        std::string text;
+        int delay;
+    };
+
+    void EndFrame(int delay)
+    {
+        if(frame.empty() && !delay)
+            return;
+        std::lock_guard<std::mutex> lock(guard);
+        queue.push_back({std::move(frame), delay});
+        frame.clear();
+        if(!spare.empty())
+        {
+            frame.swap(spare.back());
+            spare.pop_back();
+        }
+        pending.notify_one();
+    }
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(guard);
+        while(true)
+        {
+            pending.wait(lock, [this] { return stop || !queue.empty(); });
+            if(queue.empty())
+                return;
+            Chunk chunk = std::move(queue.front());
+            queue.pop_front();
+            writing = true;
+            lock.unlock();
+
+            out.write(chunk.text.data(), chunk.text.size());
+            out.flush();
+            PROFILE_COUNT(terminalBytes, chunk.text.size());
+            if(chunk.delay)
+                std::this_thread::sleep_for(std::chrono::milliseconds(chunk.delay));
+
+            lock.lock();
+            chunk.text.clear();
+            spare.push_back(std::move(chunk.text));
+            writing = false;
+            if(queue.empty())
+                idle.notify_all();
+        }
+    }
+
+    std::ostream& out;
+    std::string frame;
+    std::ostringstream format;
+    std::mutex guard;
+    std::condition_variable pending, idle;
+    std::deque<Chunk> queue;
+    std::vector<std::string> spare;
+    bool writing = false;
+    bool stop = false;
+    std::thread writer;
+};
+LogSink& logSink()
+{
+    static LogSink sink;
+    return sink;
+}
+
+class Renderer;
+class Controller;
+// Everything a game talks to besides its own state: the random
+// generator, the log sink, the map renderer and the default hero
+// controller. Games with their own contexts share no mutable state, so
+// they can run side by side on separate threads. A context without a
+// sink is headless: no output and no animation pauses.
+struct GameContext
+{
+    Rng rng;
+    LogSink* sink = nullptr;
+    Renderer* renderer = nullptr;
+    // nullptr - the terminal
+    Controller* controller = nullptr;
+    // recorded by the tracer; off for the planners' imagined turns
+    bool traced = true;
+};
+// the interactive game on this terminal
+GameContext& defaultContext();
+// no output, one per thread; for objects not yet given a context
+GameContext& quietContext();
+
 const int DELAY = 100;
-void wait(int delayTime)
+void wait(const GameContext& context, int delayTime)
 {
-    std::this_thread::sleep_for(std::chrono::milliseconds(delayTime));
+    if(context.sink)
+        context.sink->Pause(delayTime);
 }
 template<class T>
-void log(T message, std::string divider = "\n",
+void log(const GameContext& context, const T& message, const char* divider = "\n",
          colorCode fontColor = colorCode::black,
          colorCode backgroudColor = colorCode::normal,
          int delayTime = DELAY)
 {
-    std::cout << "\e[3" + std::to_string(int(fontColor)) + "m"
-              << "\e[10" + std::to_string(int(backgroudColor)) + "m"
-              << message << divider << "\e[49m";
-    wait(delayTime);
+    if(!context.sink)
+        return;
+    LogSink& sink = *context.sink;
+    sink.Append(LogSink::Font(fontColor));
+    sink.Append(LogSink::Background(backgroudColor));
+    sink.Append(message);
+    sink.Append(divider);
+    sink.Append("\e[49m");
+    wait(context, delayTime);
 }
 template<class T>
-void log(T message, colorCode fontColor)
+void log(const GameContext& context, const T& message, colorCode fontColor)
 {
-    std::cout << "\e[3" + std::to_string(int(fontColor)) + "m"
-              << message << "\n\e[49m";
+    if(!context.sink)
+        return;
+    LogSink& sink = *context.sink;
+    sink.Append(LogSink::Font(fontColor));
+    sink.Append(message);
+    sink.Append("\n\e[49m");
 }
-void log(std::string message = "", std::string divider = "\n",
+void log(const GameContext& context, const std::string& message = "", const char* divider = "\n",
          colorCode fontColor = colorCode::black)
 {
-    log<std::string>(message, divider, fontColor);
+    log<std::string>(context, message, divider, fontColor);
 }
-void log(int message, std::string divider = "\n",
+void log(const GameContext& context, int message, const char* divider = "\n",
          colorCode fontColor = colorCode::black)
 {
-    log<int>(message, divider, fontColor);
+    log<int>(context, message, divider, fontColor);
+}
+#ifdef ONECARD_HEADLESS
+// Headless builds: nothing of a log call is left, not even its arguments;
+// they are only named in an unevaluated sizeof, so they count as used.
+template<class... Args>
+char logUnused(const Args&...);
+#define log(...) ((void)sizeof(logUnused(__VA_ARGS__)))
+#endif
+
+// Timeline in Chrome Trace Event JSON (chrome://tracing, Perfetto),
+// started by --trace. Every thread records begin/end events into its own
+// ring buffer, a single producer single consumer queue without locks; a
+// flush thread drains the rings every few ms, or as soon as one is half
+// full, and writes the JSON. A full ring drops events rather than wait,
+// the drops are counted per thread. The last RESERVE slots only take end
+// events, so a recorded begin always gets its end.
+struct TraceEvent
+{
+    int64_t time;
+    const char* name;
+    int arg;
+    char phase;
+};
+
+class Tracer
+{
+public:
+    // never destroyed, threads may still hold their rings at exit
+    static Tracer& Get()
+    {
+        static Tracer* tracer = new Tracer;
+        return *tracer;
+    }
+    bool Start(const std::string& path)
+    {
+        file.open(path);
+        if(!file)
+            return false;
+        file << "[";
+        first = true;
+        start = std::chrono::steady_clock::now();
+        running = true;
+        flusher = std::thread(&Tracer::Run, this);
+        active = true;
+        return true;
+    }
+    // writes the events left and closes the file
+    void Stop()
+    {
+        if(!active)
+            return;
+        active = false;
+        {
+            std::lock_guard<std::mutex> lock(guard);
+            running = false;
+        }
+        wake.notify_all();
+        flusher.join();
+        Drain();
+        std::lock_guard<std::mutex> lock(guard);
+        uint64_t dropped = 0;
+        for(const auto& ring : rings)
+        {
+            dropped += ring->dropped;
+            Separator();
+            out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":";
+            out += std::to_string(ring->tid);
+            out += ",\"args\":{\"name\":\"thread " + std::to_string(ring->tid);
+            out += "\",\"dropped\":" + std::to_string(ring->dropped.load()) + "}}";
+        }
+        out += "\n]\n";
+        file << out;
+        out.clear();
+        file.close();
+        if(dropped)
+            std::cerr << "trace: " << dropped << " events dropped, the rings were full\n";
+    }
+    bool Active() const
+    {
+        return active.load(std::memory_order_relaxed);
+    }
+    // false - the ring is full and the event is dropped
+    bool Record(char phase, const char* name, int arg)
+    {
+        Ring& ring = Local();
+        size_t head = ring.head.load(std::memory_order_relaxed);
+        size_t used = head - ring.tail.load(std::memory_order_acquire);
+        if(used >= (phase == 'E' ? Ring::SIZE : Ring::SIZE - Ring::RESERVE))
+        {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if(used == Ring::SIZE / 2)
+            wake.notify_one();
+        int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        ring.events[head & (Ring::SIZE - 1)] = {time, name, arg, phase};
+        ring.head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Ring
+    {
+        static const size_t SIZE = 1 << 16;
+        static const size_t RESERVE = 64;
+        TraceEvent events[SIZE];
+        std::atomic<size_t> head{0}, tail{0};
+        std::atomic<uint64_t> dropped{0};
+        int tid = 0;
+    };
+
+    Ring& Local()
+    {
+        thread_local Ring* ring = nullptr;
+        if(!ring)
+        {
+            std::lock_guard<std::mutex> lock(guard);
+            rings.emplace_back(new Ring);
+            ring = rings.back().get();
+            ring->tid = int(rings.size());
+        }
+        return *ring;
+    }
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(guard);
+        while(running)
+        {
+            wake.wait_for(lock, std::chrono::milliseconds(5));
+            lock.unlock();
+            Drain();
+            lock.lock();
+        }
+    }
+    // the flush thread, or Stop once it is gone
+    void Drain()
+    {
+        std::vector<Ring*> all;
+        {
+            std::lock_guard<std::mutex> lock(guard);
+            for(const auto& ring : rings)
+                all.push_back(ring.get());
+        }
+        for(Ring* ring : all)
+        {
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t head = ring->head.load(std::memory_order_acquire);
+            for(; tail != head; tail++)
+                Write(ring->events[tail & (Ring::SIZE - 1)], ring->tid);
+            ring->tail.store(tail, std::memory_order_release);
+        }
+        file.write(out.data(), out.size());
+        file.flush();
+        out.clear();
+    }
+    void Write(const TraceEvent& event, int tid)
+    {
+        Separator();
+        out += "{\"name\":\"";
+        out += event.name;
+        out += "\",\"ph\":\"";
+        out += event.phase;
+        out += "\",\"ts\":";
+        AppendNumber(event.time / 1000);
+        char fraction[4] = {'.', char('0' + event.time / 100 % 10),
+                            char('0' + event.time / 10 % 10), char('0' + event.time % 10)};
+        out.append(fraction, 4);
+        out += ",\"pid\":1,\"tid\":";
+        AppendNumber(tid);
+        if(event.arg >= 0)
+        {
+            out += ",\"args\":{\"n\":";
+            AppendNumber(event.arg);
+            out += '}';
+        }
+        out += '}';
+    }
+    void AppendNumber(int64_t number)
+    {
+        char digits[24];
+        auto end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+        out.append(digits, end);
+    }
+    void Separator()
+    {
+        out += first ? "\n" : ",\n";
+        first = false;
+    }
+
+    std::atomic<bool> active{false};
+    std::chrono::steady_clock::time_point start;
+    std::mutex guard;
+    std::condition_variable wake;
+    bool running = false;
+    std::thread flusher;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::ofstream file;
+    std::string out;
+    bool first = true;
+};
+
+// true - the begin event is recorded and needs its end
+inline bool traceBegin(const GameContext& context, const char* name, int arg = -1)
+{
+    return context.traced && Tracer::Get().Active() && Tracer::Get().Record('B', name, arg);
 }
-void clearScrean()
+inline void traceEnd(const char* name)
 {
-    log("\x1b[2J\x1b[H");
+    Tracer::Get().Record('E', name, -1);
 }
+class TraceScope
+{
+public:
+    TraceScope(const GameContext& context, const char* name, int arg = -1)
+        :name(name), begun(traceBegin(context, name, arg))
+    {
+    }
+    ~TraceScope()
+    {
+        if(begun)
+            traceEnd(name);
+    }
+
+private:
+    const char* name;
+    bool begun;
+};
 
 enum class cell
 {
@@ -146,14 +869,21 @@ struct coord
         if(y) pos.y = y/abs(y);
         return pos;
     }
-    double distance(coord to = coord(0,0)) const
+    // squared euclidean distance, exact in integers
+    int distance2(coord to = coord(0,0)) const
     {
         coord radius(*this - to);
-        return sqrt(radius.x*radius.x + radius.y*radius.y);
+        return radius.x*radius.x + radius.y*radius.y;
+    }
+    // king moves between the cells
+    int chebyshev(coord to = coord(0,0)) const
+    {
+        return std::max(abs(x - to.x), abs(y - to.y));
     }
-    bool isAdjacent(coord to, int atthackRange = 2)
+    // distance at most half the range: 4 * distance2 <= range^2
+    bool isAdjacent(coord to, int atthackRange = 2) const
     {
-        return distance(to) <= 0.5 * atthackRange;
+        return 4 * distance2(to) <= atthackRange * atthackRange;
     }
 
     coord operator+ (const coord& other) const
@@ -176,11 +906,11 @@ struct coord
     }
     bool operator< (const coord& other) const
     {
-        return (distance() < other.distance());
+        return distance2() < other.distance2();
     }
     bool operator<= (const coord& other) const
     {
-        return (distance() <= other.distance());
+        return distance2() <= other.distance2();
     }
     bool operator== (const coord& other) const
     {
@@ -193,81 +923,608 @@ struct coord
     }
 };
 
-int MAX_ROW = 5;
-int MAX_COL = 5;
-class Field
+const int DEFAULT_ROWS = 5;
+const int DEFAULT_COLS = 5;
+// the largest map a level file may ask for
+const int MAX_CELLS = 1 << 20;
+
+inline int popcount(uint64_t bits)
 {
-public:
-    Field()
+#ifdef _MSC_VER
+    return int(__popcnt64(bits));
+#else
+    return __builtin_popcountll(bits);
+#endif
+}
+inline int lowestBit(uint64_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return int(index);
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+// Zobrist keys: a fixed pseudo-random word per state feature (tag in
+// the top byte). A state hash is the XOR of the keys of everything in
+// the state, so every change updates it in O(1).
+inline uint64_t zobrist(uint64_t feature)
+{
+    uint64_t z = (feature + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+// cell type on cell number index
+inline uint64_t zobristCell(int index, cell type)
+{
+    return zobrist(uint64_t(type) << 56 | uint64_t(uint32_t(index)));
+}
+
+// Calls f(coord) for every cell strictly between from and to on the
+// Bresenham line. The line is always walked from the lower end, so the
+// cells from a to b and from b to a are the same.
+template<class F>
+void bresenham(coord from, coord to, F f)
+{
+    if(from == to)
+        return;
+    if(to.x < from.x || (to.x == from.x && to.y < from.y))
+        std::swap(from, to);
+    int dx = abs(to.x - from.x), sx = from.x < to.x ? 1 : -1;
+    int dy = -abs(to.y - from.y), sy = from.y < to.y ? 1 : -1;
+    int err = dx + dy;
+    coord p = from;
+    while(true)
     {
-        for(int i = 0; i < MAX_ROW; i++)
+        int e2 = 2 * err;
+        if(e2 >= dy)
         {
-            grid.push_back(std::vector<cell>());
-            for(int j = 0; j < MAX_COL; j++)
-            {
-                grid.at(i).push_back(cell::empty);
+            err += dy;
+            p.x += sx;
+        }
+        if(e2 <= dx)
+        {
+            err += dx;
+            p.y += sy;
+        }
+        if(p == to)
+            return;
+        f(p);
+    }
+}
+
+// Between-cells masks for every (from, to) pair of a single word map.
+// They depend only on the map size, so one table is shared by all maps
+// of that size and walls or monsters never invalidate it.
+const std::vector<uint64_t>* sightTable(int rows, int cols)
+{
+    static std::mutex guard;
+    static std::map<std::pair<int, int>, std::vector<uint64_t>> tables;
+    std::lock_guard<std::mutex> lock(guard);
+    auto& table = tables[{rows, cols}];
+    if(table.empty())
+    {
+        int n = rows * cols;
+        table.assign(n * n, 0);
+        for(int a = 0; a < n; a++)
+            for(int b = 0; b < n; b++)
+            {
+                if(a == b)
+                    continue;
+                uint64_t mask = 0;
+                bresenham({a / cols, a % cols}, {b / cols, b % cols}, [&](coord p) {
+                    mask |= 1ull << (p.x * cols + p.y);
+                });
+                table[a * n + b] = mask;
+            }
+    }
+    return &table;
+}
+
+// Cells within attack range of every cell of a single word map, one
+// word per (range, cell) for the ranges below RANGE_MASKS, same test as
+// coord::isAdjacent. Shared by all maps of the size like sightTable.
+const int RANGE_MASKS = 16;
+const std::vector<uint64_t>* rangeTable(int rows, int cols)
+{
+    static std::mutex guard;
+    static std::map<std::pair<int, int>, std::vector<uint64_t>> tables;
+    std::lock_guard<std::mutex> lock(guard);
+    auto& table = tables[{rows, cols}];
+    if(table.empty())
+    {
+        int n = rows * cols;
+        table.assign(RANGE_MASKS * n, 0);
+        for(int range = 0; range < RANGE_MASKS; range++)
+            for(int a = 0; a < n; a++)
+                for(int b = 0; b < n; b++)
+                    if(coord(a / cols, a % cols).isAdjacent({b / cols, b % cols}, range))
+                        table[range * n + a] |= 1ull << b;
+    }
+    return &table;
+}
+
+template<class FieldT>
+void drawField(const GameContext& context, const FieldT& field, colorCode color);
+
+// The map is kept as one bit plane per cell type (wall, hero, enemy),
+// row major: bit x*cols+y. Maps up to 8x8 fit one word per plane stored
+// inline, larger maps use one flat buffer holding all three planes.
+// BasicField<R, C> fixes the size at compile time, so the small common
+// sizes get constant loop bounds and inline planes of any word count,
+// and the object is only the planes and the hash; Field is sized at run
+// time.
+template<bool Fixed>
+struct FieldShape
+{
+    int rows = 0, cols = 0;
+    int words = 0;
+    std::vector<uint64_t> bits;
+    const std::vector<uint64_t>* sight = nullptr;
+    const std::vector<uint64_t>* ranges = nullptr;
+};
+template<>
+struct FieldShape<true>
+{
+};
+
+template<int R = 0, int C = 0>
+class BasicField : private FieldShape<(R > 0 && C > 0)>
+{
+    static constexpr bool fixed = R > 0 && C > 0;
+    static constexpr int fixedWords = fixed ? (R * C + 63) / 64 : 1;
+
+public:
+    BasicField([[maybe_unused]] int rows = fixed ? R : DEFAULT_ROWS,
+               [[maybe_unused]] int cols = fixed ? C : DEFAULT_COLS)
+    {
+        if constexpr(!fixed)
+        {
+            this->rows = rows;
+            this->cols = cols;
+            this->words = (rows * cols + 63) / 64;
+            if(Words() > fixedWords)
+                this->bits.assign(3 * Words(), 0);
+            if(Words() == 1)
+            {
+                this->sight = sightTable(Rows(), Cols());
+                this->ranges = rangeTable(Rows(), Cols());
             }
         }
     }
+    int Rows() const
+    {
+        if constexpr(fixed)
+            return R;
+        else
+            return this->rows;
+    }
+    int Cols() const
+    {
+        if constexpr(fixed)
+            return C;
+        else
+            return this->cols;
+    }
+    int Words() const
+    {
+        if constexpr(fixed)
+            return fixedWords;
+        else
+            return this->words;
+    }
+    bool isInside(coord pos) const
+    {
+        return unsigned(pos.x) < unsigned(Rows()) && unsigned(pos.y) < unsigned(Cols());
+    }
+    int Index(coord pos) const
+    {
+        return pos.x * Cols() + pos.y;
+    }
+    coord Pos(int index) const
+    {
+        return {index / Cols(), index % Cols()};
+    }
     void AddWall(coord pos)
     {
-        grid.at(pos.x).at(pos.y) = cell::wall;
+        SetCell(pos, cell::wall);
     }
     void SetCell(coord pos, cell type)
     {
-        grid.at(pos.x).at(pos.y) = type;
+        int i = Index(pos);
+        cell old = GetCell(pos);
+        if(old != cell::empty)
+            hash ^= zobristCell(i, old);
+        if(type != cell::empty)
+            hash ^= zobristCell(i, type);
+        uint64_t bit = 1ull << (i & 63);
+        int word = i >> 6;
+        Plane(cell::wall)[word] &= ~bit;
+        Plane(cell::hero)[word] &= ~bit;
+        Plane(cell::enemy)[word] &= ~bit;
+        if(type != cell::empty)
+            Plane(type)[word] |= bit;
     }
-    cell GetCell(coord pos)
+    cell GetCell(coord pos) const
     {
-        return grid.at(pos.x).at(pos.y);
+        int i = Index(pos);
+        uint64_t bit = 1ull << (i & 63);
+        int word = i >> 6;
+        if(Plane(cell::wall)[word] & bit)
+            return cell::wall;
+        if(Plane(cell::hero)[word] & bit)
+            return cell::hero;
+        if(Plane(cell::enemy)[word] & bit)
+            return cell::enemy;
+        return cell::empty;
     }
     bool isFree(coord pos) const
     {
-        if(pos.x < 0 || pos.x >= MAX_ROW)
+        if(!isInside(pos))
             return false;
-        if(pos.y < 0 || pos.y >= MAX_COL)
-            return false;
-        return grid.at(pos.x).at(pos.y) == cell::empty;
+        int i = Index(pos);
+        return !((Occupied(i >> 6) >> (i & 63)) & 1);
     }
-    void Print(colorCode color = colorCode::normal) const
+    // walls, hero and enemies of word number word
+    uint64_t Occupied(int word = 0) const
     {
-        std::stringstream ss;
-        int enemyID = 0;
-        for(auto &row : grid)
+        return Plane(cell::wall)[word] | Plane(cell::hero)[word] | Plane(cell::enemy)[word];
+    }
+    // replaces the wall plane with Words() words, cells already taken by
+    // the hero or an enemy stay theirs
+    void SetWalls(const void* words)
+    {
+        uint64_t* walls = Plane(cell::wall);
+        HashWalls();
+        std::memcpy(walls, words, Words() * sizeof(uint64_t));
+        for(int w = 0; w < Words(); w++)
+            walls[w] &= ~(Plane(cell::hero)[w] | Plane(cell::enemy)[w]);
+        HashWalls();
+    }
+    // Zobrist hash of the cells, kept up to date on every change
+    uint64_t Hash() const
+    {
+        return hash;
+    }
+    // loads all three planes, Words() words each, and their hash
+    void SetPlanes(const uint64_t* walls, const uint64_t* heroes, const uint64_t* enemies,
+                   uint64_t planesHash)
+    {
+        std::memcpy(Plane(cell::wall), walls, Words() * sizeof(uint64_t));
+        std::memcpy(Plane(cell::hero), heroes, Words() * sizeof(uint64_t));
+        std::memcpy(Plane(cell::enemy), enemies, Words() * sizeof(uint64_t));
+        hash = planesHash;
+    }
+    const uint64_t* Plane(cell type) const
+    {
+        if constexpr(fixed)
+            return &small[(int(type) - 1) * fixedWords];
+        else
+            return Words() == fixedWords ? &small[(int(type) - 1) * fixedWords]
+                                         : &this->bits[(int(type) - 1) * Words()];
+    }
+    int Count(cell type) const
+    {
+        int count = 0;
+        for(int w = 0; w < Words(); w++)
+            count += popcount(Plane(type)[w]);
+        return count;
+    }
+    int CountEnemies() const
+    {
+        return Count(cell::enemy);
+    }
+    // calls f(coord) for every cell of the type, row major
+    template<class F>
+    void ForEachCell(cell type, F f) const
+    {
+        const uint64_t* plane = Plane(type);
+        for(int w = 0; w < Words(); w++)
+            for(uint64_t b = plane[w]; b; b &= b - 1)
+                f(Pos(w * 64 + lowestBit(b)));
+    }
+    // 3x3 block centred on pos, single word maps only
+    uint64_t NeighbourMask(coord pos) const
+    {
+        uint64_t row = 0;
+        for(int j = pos.y - 1; j <= pos.y + 1; j++)
+            if(unsigned(j) < unsigned(Cols()))
+                row |= 1ull << j;
+        uint64_t mask = 0;
+        for(int i = pos.x - 1; i <= pos.x + 1; i++)
+            if(unsigned(i) < unsigned(Rows()))
+                mask |= row << (i * Cols());
+        return mask;
+    }
+    // calls f(coord) for every free cell of the 3x3 block, row major
+    template<class F>
+    void ForEachFreeNeighbour(coord pos, F f) const
+    {
+        if(Words() == 1)
+        {
+            for(uint64_t b = NeighbourMask(pos) & ~Occupied(); b; b &= b - 1)
+                f(Pos(lowestBit(b)));
+            return;
+        }
+        for(int i = pos.x - 1; i <= pos.x + 1; i++)
+            for(int j = pos.y - 1; j <= pos.y + 1; j++)
+                if(isFree({i, j}))
+                    f(coord(i, j));
+    }
+    void Clear()
+    {
+        for(cell type : {cell::wall, cell::hero, cell::enemy})
+            std::fill(Plane(type), Plane(type) + Words(), 0);
+        hash = 0;
+    }
+    // every enemy can be reached from pos through the cells without
+    // walls, moving in 8 directions like the monsters do
+    bool EnemiesReachable(coord pos) const
+    {
+        if(Words() == 1)
         {
-            for(auto &el : row)
+            uint64_t all = Rows() * Cols() == 64 ? ~0ull : (1ull << (Rows() * Cols())) - 1;
+            uint64_t notFirstCol = 0;
+            for(int i = 0; i < Rows(); i++)
+                notFirstCol |= ((1ull << (Cols() - 1)) - 1) << (i * Cols() + 1);
+            uint64_t notLastCol = notFirstCol >> 1;
+            uint64_t open = all & ~Plane(cell::wall)[0];
+            uint64_t reach = 1ull << Index(pos), last = 0;
+            // 3x3 dilation until nothing new is reached
+            while(reach != last)
             {
-                ss << '|';
-                if(el == cell::enemy)
-                {
-                    ss << enemyID;
-                    enemyID++;
-                }
-                else
+                last = reach;
+                uint64_t row = reach | ((reach << 1) & notFirstCol) | ((reach >> 1) & notLastCol);
+                reach = (row | (row << Cols()) | (row >> Cols())) & open;
+            }
+            return (Plane(cell::enemy)[0] & ~reach) == 0;
+        }
+        thread_local std::vector<int> queue;
+        thread_local std::vector<char> seen;
+        queue.assign(1, Index(pos));
+        seen.assign(Rows() * Cols(), 0);
+        seen[Index(pos)] = 1;
+        int found = 0;
+        for(size_t k = 0; k < queue.size(); k++)
+        {
+            coord p = Pos(queue[k]);
+            if(GetCell(p) == cell::enemy)
+                found++;
+            for(int i = p.x - 1; i <= p.x + 1; i++)
+                for(int j = p.y - 1; j <= p.y + 1; j++)
                 {
-                    ss << CellToDraw(el);
+                    if(!isInside({i, j}) || seen[Index({i, j})] || GetCell({i, j}) == cell::wall)
+                        continue;
+                    seen[Index({i, j})] = 1;
+                    queue.push_back(Index({i, j}));
                 }
-            }
-            ss << "|\n";
         }
-        log(ss.str(), color);
+        return found == CountEnemies();
+    }
+    // RangeMask works for the range on this map
+    bool HasRangeMask(int range) const
+    {
+        return Words() == 1 && unsigned(range) < unsigned(RANGE_MASKS);
+    }
+    // cells within range of center, see HasRangeMask
+    uint64_t RangeMask(coord center, int range) const
+    {
+        return Ranges()[range * Rows() * Cols() + Index(center)];
+    }
+    // nothing stands on the line between the two cells
+    bool isClearLine(coord from, coord to) const
+    {
+        if(Words() == 1)
+            return !(Sight()[Index(from) * Rows() * Cols() + Index(to)] & Occupied());
+        bool clear = true;
+        bresenham(from, to, [&](coord p) {
+            clear = clear && isFree(p);
+        });
+        return clear;
+    }
+    void Print(const GameContext& context, colorCode color = colorCode::normal) const
+    {
+        drawField(context, *this, color);
     }
     bool Move(coord from, coord to)
     {
-        if(to.x >= 0 && to.x < MAX_ROW &&
-            to.y >= 0 && to.y < MAX_COL)
+        if(isInside(to))
         {
-            std::swap(grid.at(from.x).at(from.y),
-                      grid.at(to.x).at(to.y));
+            cell moved = GetCell(from);
+            SetCell(from, GetCell(to));
+            SetCell(to, moved);
             return true;
         }
         return false;
     }
 
 private:
-    // 5x5
-    std::vector<std::vector<cell>> grid;
+    uint64_t* Plane(cell type)
+    {
+        return const_cast<uint64_t*>(static_cast<const BasicField*>(this)->Plane(type));
+    }
+    // the tables of single word maps, shared by all maps of the size
+    const std::vector<uint64_t>& Sight() const
+    {
+        if constexpr(fixed)
+        {
+            static const std::vector<uint64_t>* table = sightTable(R, C);
+            return *table;
+        }
+        else
+            return *this->sight;
+    }
+    const std::vector<uint64_t>& Ranges() const
+    {
+        if constexpr(fixed)
+        {
+            static const std::vector<uint64_t>* table = rangeTable(R, C);
+            return *table;
+        }
+        else
+            return *this->ranges;
+    }
+    // toggles the keys of all walls
+    void HashWalls()
+    {
+        for(int w = 0; w < Words(); w++)
+            for(uint64_t rest = Plane(cell::wall)[w]; rest; rest &= rest - 1)
+                hash ^= zobristCell(w * 64 + lowestBit(rest), cell::wall);
+    }
+
+    uint64_t hash = 0;
+    uint64_t small[3 * fixedWords] = {};
+};
+using Field = BasicField<>;
+template<int Rows, int Cols>
+using FixedField = BasicField<Rows, Cols>;
+static_assert(sizeof(FixedField<5, 5>) == 4 * sizeof(uint64_t), "a fixed map is its planes and hash");
+
+// Terminal renderer for the map. The map is pinned to the top rows and
+// the log scrolls in the region below it. The last drawn frame is kept,
+// so a redraw only emits cursor-addressed updates of the changed cells,
+// all in one write. A new size, color or enemy ID width draws it whole.
+class Renderer
+{
+public:
+    Renderer(LogSink& output): sink(output) {}
+    ~Renderer()
+    {
+        if(rows)
+            sink.Append("\e[r");
+    }
+
+    template<class FieldT>
+    void Draw(const FieldT& field, colorCode color)
+    {
+        PROFILE_SCOPE(render);
+        int enemies = field.CountEnemies();
+        int newWidth = 1;
+        for(int n = enemies - 1; n >= 10; n /= 10)
+            newWidth++;
+        bool full = field.Rows() != rows || field.Cols() != cols
+            || newWidth != width || color != this->color;
+        rows = field.Rows();
+        cols = field.Cols();
+        width = newWidth;
+        this->color = color;
+
+        out.clear();
+        if(full)
+        {
+            previous.assign(rows * cols, ~0u);
+            // whole frame with the borders, then the log region below it
+            out += "\e[r\e[2J\e[H";
+            out += LogSink::Font(color);
+            for(int i = 0; i < rows; i++)
+            {
+                for(int j = 0; j < cols; j++)
+                {
+                    out += '|';
+                    out.append(width, ' ');
+                }
+                out += "|\n";
+            }
+            out += "\e[49m\e[";
+            AppendNumber(rows + 2);
+            out += "r\e[";
+            AppendNumber(rows + 2);
+            out += ";1H";
+        }
+
+        out += "\e7";
+        out += LogSink::Font(color);
+        int enemyID = 0;
+        for(int i = 0; i < rows; i++)
+        {
+            for(int j = 0; j < cols; j++)
+            {
+                cell el = field.GetCell({i, j});
+                unsigned glyph = unsigned(el) << 24;
+                if(el == cell::enemy)
+                    glyph |= unsigned(enemyID++);
+                unsigned& last = previous[i * cols + j];
+                if(glyph == last)
+                    continue;
+                last = glyph;
+                out += "\e[";
+                AppendNumber(i + 1);
+                out += ';';
+                AppendNumber(j * (width + 1) + 2);
+                out += 'H';
+                int drawn = 1;
+                if(el == cell::enemy)
+                    drawn = AppendNumber(glyph & 0xffffff);
+                else
+                    out += CellToDraw(el);
+                out.append(width - drawn, ' ');
+            }
+        }
+        out += "\e[49m\e8";
+        sink.Append(out);
+    }
+    // wipes the log region, the map stays
+    void ClearLog()
+    {
+        if(!rows)
+        {
+            sink.Append("\x1b[2J\x1b[H");
+            return;
+        }
+        out = "\e[";
+        AppendNumber(rows + 2);
+        out += ";1H\e[J";
+        sink.Append(out);
+    }
+
+private:
+    int AppendNumber(int number)
+    {
+        char digits[16];
+        auto end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+        out.append(digits, end);
+        return int(end - digits);
+    }
+
+    LogSink& sink;
+    int rows = 0, cols = 0;
+    int width = 0;
+    colorCode color = colorCode::normal;
+    std::vector<unsigned> previous;
+    std::string out;
 };
+GameContext& defaultContext()
+{
+#ifdef ONECARD_HEADLESS
+    static GameContext context = {Rng(std::random_device{}())};
+#else
+    // the sink is created first, so it outlives the renderer
+    static Renderer terminal(logSink());
+    static GameContext context = {Rng(std::random_device{}()), &logSink(), &terminal};
+#endif
+    return context;
+}
+GameContext& quietContext()
+{
+    thread_local GameContext context;
+    return context;
+}
+template<class FieldT>
+void drawField(const GameContext& context, const FieldT& field, colorCode color)
+{
+    if(context.renderer)
+        context.renderer->Draw(field, color);
+}
+void clearScrean(const GameContext& context)
+{
+    if(!context.renderer)
+        return;
+    context.renderer->ClearLog();
+    wait(context, DELAY);
+}
 
 struct Stats
 {
@@ -286,10 +1543,10 @@ struct Stats
         defence = def;
         range = ran;
     }
-    void PrintHP()  const
+    void PrintHP(const GameContext& context)  const
     {
-        log("HP:", " ");
-        log(health);
+        log(context, "HP:", " ");
+        log(context, health);
     }
     friend std::ostream& operator<<(std::ostream& os, Stats stats)
     {
@@ -303,6 +1560,37 @@ struct Stats
     }
 };
 
+// a character with these stats on cell number index
+inline uint64_t zobristStats(const Stats& stats, int index = 0xffff)
+{
+    return zobrist(uint64_t(4 | uint32_t(index) >> 16 << 4) << 56 | uint64_t(uint16_t(index)) << 40
+                   | uint64_t(uint8_t(stats.health)) << 32 | uint64_t(uint8_t(stats.move)) << 24
+                   | uint64_t(uint8_t(stats.attack)) << 16 | uint64_t(uint8_t(stats.defence)) << 8
+                   | uint64_t(uint8_t(stats.range)));
+}
+
+void defend(const GameContext& context, Stats& stats, const std::string& name, int attackDamage)
+{
+    int damage = attackDamage/stats.defence;
+    stats.health -= damage;
+    switch (damage) {
+    case 0:
+        log(context, ") Defended (", colorCode::yellow);
+        break;
+    case 1:
+        log(context, "> Damaged <", colorCode::blue);
+        break;
+    case 2:
+        log(context, ">> Smashed <<", colorCode::blue);
+        break;
+    default:
+        log(context, "** Lethaly wounded **", colorCode::red);
+        break;
+    if(stats.health <= 0)
+        log(context, "## " + name+" is dead ##", colorCode::red);
+    }
+}
+
 class Character
 {
 public:
@@ -310,6 +1598,14 @@ public:
     {
         this->name = name;
     }
+    void SetContext(GameContext& context)
+    {
+        this->context = &context;
+    }
+    GameContext& Context() const
+    {
+        return *context;
+    }
     void SetPosition(int x, int y)
     {
         pos = {x, y};
@@ -356,20 +1652,20 @@ public:
     {
         return name;
     }
-    void Move(direction d)
+    void Move(direction d, const Field& field)
     {
         if(stats.move < 2 ||
             (stats.move < 3 && d >= direction::leftUp))
         {
-            log("not enough movement");
+            log(*context, "not enough movement");
             return;
         }
         if(((d == direction::left || d == direction::leftUp || d == direction::leftDown) && pos.x == 0) ||
-            ((d == direction::right || d == direction::rightUp || d == direction::rightDown) && pos.x == MAX_COL-1) ||
+            ((d == direction::right || d == direction::rightUp || d == direction::rightDown) && pos.x == field.Cols()-1) ||
             ((d == direction::up || d == direction::leftUp || d == direction::rightUp) && pos.y == 0) ||
-            ((d == direction::down || d == direction::leftDown || d == direction::rightDown) && pos.y == MAX_ROW-1))
+            ((d == direction::down || d == direction::leftDown || d == direction::rightDown) && pos.y == field.Rows()-1))
         {
-            log("coordinates out of map, nothing happen");
+            log(*context, "coordinates out of map, nothing happen");
             return;
         }
 
@@ -394,81 +1690,137 @@ public:
     }
     void Defend(int attackDamage)
     {
-        int damage = attackDamage/stats.defence;
-        stats.health -= damage;
-        switch (damage) {
-        case 0:
-            log(") Defended (", colorCode::yellow);
-            break;
-        case 1:
-            log("> Damaged <", colorCode::blue);
-            break;
-        case 2:
-            log(">> Smashed <<", colorCode::blue);
-            break;
-        default:
-            log("** Lethaly wounded **", colorCode::red);
-            break;
-        if(stats.health <= 0)
-            log("## " + name+" is dead ##", colorCode::red);
-        }
+        defend(*context, stats, name, attackDamage);
     }
     void Print() const
     {
-        log(name);
-        log<Stats>(stats);
+        log(*context, name);
+        log<Stats>(*context, stats);
     }
 protected:
+    GameContext* context = &quietContext();
     std::string name;
     coord pos;
     Stats stats;
 };
 
-bool lineOfSight(const Field& field, coord from, coord to, int range)
+template<class FieldT>
+bool lineOfSight(const FieldT& field, coord from, coord to, int range)
 {
-    coord step = to - from;
+    PROFILE_SCOPE(lineOfSight);
+    if(!from.isAdjacent(to, range))
+        return false;
+    PROFILE_COUNT(losQueries, 1);
+    return field.isClearLine(from, to);
+}
+// Cost to reach the target from every cell, 2 per straight and 3 per
+// diagonal step, walls are impassable. Built once per enemies turn and
+// shared by all monsters, so each step is a lookup of the 8 neighbours.
+// Single word maps keep the field of every target built so far for the
+// current walls, so the same level turn after turn (and game after game)
+// builds each target once.
+class FlowField
+{
+public:
+    static const coord steps[8];
+    static constexpr int unreachable = 1 << 30;
 
-    // in range
-    if(step.distance() <= range * 0.5)
+    template<class FieldT>
+    void Build(const FieldT& field, coord target)
     {
-        if(step.distance() == 1)
-            return true;
-
-        bool sight = true;
-        if(step.x == 0)
+        int cells = field.Rows() * field.Cols();
+        if(field.Words() > 1)
         {
-            for(int i = 1; i < step.y; i++)
-            {
-                if(!field.isFree({from.x, from.y+i}))
-                {
-                        sight = false;
-                }
-            }
+            rows = field.Rows();
+            cols = field.Cols();
+            walls = 0;
+            built.clear();
+            offset = 0;
+            Dial(field, target, cells);
+            return;
         }
-        if(step.y == 0)
+        uint64_t wallPlane = field.Plane(cell::wall)[0];
+        if(field.Rows() != rows || field.Cols() != cols || wallPlane != walls || built.empty())
         {
-            for(int i = 1; i < step.x; i++)
-            {
-                if(!field.isFree({from.x+i, from.y}))
-                {
-                        sight = false;
-                }
-            }
+            rows = field.Rows();
+            cols = field.Cols();
+            walls = wallPlane;
+            built.assign(cells, 0);
+            distance.resize(cells * cells);
+        }
+        int index = field.Index(target);
+        offset = index * cells;
+        if(!built[index])
+        {
+            Dial(field, target, cells);
+            built[index] = 1;
         }
-        if(step.x == step.y && step.distance() )
+    }
+    int Distance(coord pos) const
+    {
+        if(unsigned(pos.x) >= unsigned(rows) || unsigned(pos.y) >= unsigned(cols))
+            return unreachable;
+        return distance[offset + pos.x * cols + pos.y];
+    }
+
+private:
+    // Dial's algorithm into distance[offset..], the step costs fit in 4
+    // rotating buckets
+    template<class FieldT>
+    void Dial(const FieldT& field, coord target, int cells)
+    {
+        if(int(distance.size()) < offset + cells)
+            distance.resize(offset + cells);
+        int* reach = distance.data() + offset;
+        std::fill(reach, reach + cells, unreachable);
+        for(auto &bucket : buckets)
+            bucket.clear();
+
+        reach[field.Index(target)] = 0;
+        buckets[0].push_back(field.Index(target));
+        int pending = 1;
+        for(int d = 0; pending; d++)
         {
-            for(int i = 1; i < step.x; i++)
+            std::vector<int>& bucket = buckets[d % 4];
+            for(size_t k = 0; k < bucket.size(); k++)
             {
-                if(!field.isFree({from.x+i, from.y+i}))
+                int index = bucket[k];
+                pending--;
+                if(reach[index] != d)
+                    continue;
+                coord pos = field.Pos(index);
+                for(const coord& step : steps)
                 {
-                        sight = false;
+                    coord next = pos + step;
+                    if(!field.isInside(next) || field.GetCell(next) == cell::wall)
+                        continue;
+                    int cost = (step.x && step.y) ? 3 : 2;
+                    int& nextDistance = reach[field.Index(next)];
+                    if(d + cost < nextDistance)
+                    {
+                        nextDistance = d + cost;
+                        buckets[(d + cost) % 4].push_back(field.Index(next));
+                        pending++;
+                    }
                 }
             }
+            bucket.clear();
         }
-        return sight;
     }
-    return false;
-}
+
+    int rows = 0, cols = 0;
+    // the walls the built fields are for, single word maps
+    uint64_t walls = 0;
+    // by target cell, empty - nothing cached
+    std::vector<char> built;
+    // the target's field starts at offset
+    int offset = 0;
+    std::vector<int> distance;
+    std::vector<int> buckets[4];
+};
+const coord FlowField::steps[8] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1},
+                                   {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+
 enum class monster
 {
     spider,
@@ -510,96 +1862,520 @@ public:
         this->stats = stats;
         this->pos = pos;
     }
-    void Move(coord to, Field& field)
+};
+
+// Cells within attack range of (0, 0), row major, same test as
+// coord::isAdjacent. One list per range, built on first use.
+const std::vector<coord>& rangeOffsets(int range)
+{
+    thread_local std::vector<std::vector<coord>> offsets;
+    if(range >= int(offsets.size()))
+        offsets.resize(range + 1);
+    std::vector<coord>& cells = offsets[range];
+    if(cells.empty())
     {
-        int speed = stats.move;
-        while(speed > 1)
-        {
-            coord step = to - pos;
+        int reach = range / 2;
+        for(int i = -reach; i <= reach; i++)
+            for(int j = -reach; j <= reach; j++)
+                if(coord(i, j).isAdjacent({0, 0}, range))
+                    cells.push_back({i, j});
+    }
+    return cells;
+}
 
-            // adjacent
-            if(step.distance() <= stats.range * 0.5
-                && lineOfSight(field, pos, to, stats.range))
-            {
-                return;
-            }
+// Generation-checked reference to a monster. It stays valid while the
+// monster lives, whatever other monsters die.
+struct EnemyHandle
+{
+    int slot = -1;
+    uint32_t generation = 0;
+};
 
-            if(step.x != 0 && step.y != 0
-                && speed > 2 && field.isFree(pos + step.direction()))
-            {
-                log("\tMonster move diagonal");
-                pos += step.direction();
-                step -= step.direction();
-                speed -= 3;
-            }
-            else if((step.x != 0 || step.y != 0))
-            {
-                //priority vertical movement
-                if(step.x != 0 && field.isFree(pos + coord(step.direction().x, 0)))
-                {
-                    log("\tMonster move vertical");
-                    pos.x += step.direction().x;
-                    step.x -= step.direction().x;
-                    speed -= 2;
-                }
-                else if(step.y != 0 && field.isFree(pos + coord(0, step.direction().y)) && speed > 1)
-                {
-                    log("\tMonster move horizontal");
-                    pos.y += step.direction().y;
-                    step.y -= step.direction().y;
-                    speed -= 2;
-                }
-                else
-                {
-                    // TO DO !
-                    log("\tMonster don't know");
-                    std::vector<coord> adj;
-                    for(int i = pos.x-1; i <= pos.x+1; i++)
-                        for(int j = pos.y-1; j <= pos.y+1; j++)
-                            if(field.isFree({i, j}))
-                                adj.push_back({i, j});
-                    std::sort(adj.begin(), adj.end());
-                    int count = 0;
-                    for(auto &p : adj)
-                    {
-                        if(p.distance(to) == adj.front().distance(to))
-                            count++;
-                    }
-                    int index = rng(count);
+// Whole state of a level in a fixed layout, no pointers and no heap: a
+// copy is a memcpy and the bytes go to disk as they are. Holds maps up
+// to 256 cells and 16 monsters; custom monster kinds (beyond the
+// archetypes) keep their number but not their name.
+struct LevelSnapshot
+{
+    static const int WORDS = 4;
+    static const int MONSTERS = 16;
+    struct Unit
+    {
+        uint8_t x, y;
+        uint8_t kind;
+        uint8_t slot;
+        int8_t stats[5];
+        uint8_t reserved[3];
+    };
 
-                    if(adj.at(index).distance() > 1)
-                        speed -= 3;
-                    else
-                        speed -= 2;
-                    pos = adj.at(index);
-                }
-            }
-            else
-            {
-                log("\tMonster don't move");
-                return;
-            }
-            log("\t" + name + " is at ", " ");
-            log(pos);
-        }
-    }
+    int32_t id;
+    uint8_t rows, cols;
+    uint8_t heroX, heroY;
+    int8_t hero[5];
+    int8_t heroBase[5];
+    uint8_t monsterCount;
+    uint8_t slotCount;
+    uint64_t fieldHash;
+    uint64_t enemiesHash;
+    // wall, hero and enemy planes
+    uint64_t planes[3][WORDS];
+    // by monster number
+    Unit units[MONSTERS];
+    // by handle slot
+    uint32_t generations[MONSTERS];
 };
+static_assert(std::is_trivially_copyable<LevelSnapshot>::value, "snapshot is copied as bytes");
 
-class Hero : public Character
+// health, move, attack, defence, range
+inline void packStats(const Stats& stats, int8_t* packed)
 {
-public:
-    Hero(std::string name = "Hero")
-        :Character(name)
+    packed[0] = int8_t(stats.health);
+    packed[1] = int8_t(stats.move);
+    packed[2] = int8_t(stats.attack);
+    packed[3] = int8_t(stats.defence);
+    packed[4] = int8_t(stats.range);
+}
+inline Stats unpackStats(const int8_t* packed)
+{
+    return Stats(packed[0], packed[1], packed[2], packed[3], packed[4]);
+}
+
+// stats a fight can use: defence divides the damage, range and move
+// index the offset and reach tables; the hero's current move may be
+// spent below zero, the next roll sets it again
+inline bool validStats(const Stats& stats, bool spentMove = false)
+{
+    return (spentMove || stats.move >= 0) && stats.attack >= 0 && stats.defence > 0 && stats.range >= 0;
+}
+
+// A snapshot from outside (a save, a replay) is only restored if it is
+// one a level could have written: the map fits the planes, the hero and
+// the monsters are inside it on their own cells and match the hero and
+// enemy planes, the monsters are known kinds in distinct handle slots
+// with the stats of their kind (but health), the hero's stats are usable.
+bool validSnapshot(const LevelSnapshot& snapshot)
+{
+    int rows = snapshot.rows, cols = snapshot.cols;
+    int cells = rows * cols;
+    if(snapshot.id < 0 || !rows || !cols || cells > LevelSnapshot::WORDS * 64
+        || snapshot.heroX >= rows || snapshot.heroY >= cols
+        || snapshot.slotCount > LevelSnapshot::MONSTERS || snapshot.monsterCount > snapshot.slotCount
+        || !validStats(unpackStats(snapshot.hero), true) || !validStats(unpackStats(snapshot.heroBase)))
+        return false;
+    uint64_t heroes[LevelSnapshot::WORDS] = {}, enemies[LevelSnapshot::WORDS] = {};
+    heroes[(snapshot.heroX * cols + snapshot.heroY) / 64] |= 1ull << ((snapshot.heroX * cols + snapshot.heroY) % 64);
+    uint32_t slots = 0;
+    for(int i = 0; i < snapshot.monsterCount; i++)
     {
-//        baseStats = Stats(6, 1, 1, 1, 2);
+        const LevelSnapshot::Unit& unit = snapshot.units[i];
+        if(unit.x >= rows || unit.y >= cols || unit.kind > uint8_t(monster::dragon)
+            || unit.slot >= snapshot.slotCount || (slots >> unit.slot & 1))
+            return false;
+        slots |= 1u << unit.slot;
+        Stats stats = unpackStats(unit.stats);
+        Stats kind = Monster(monster(unit.kind), {0, 0}).GetStats();
+        if(stats.move != kind.move || stats.attack != kind.attack
+            || stats.defence != kind.defence || stats.range != kind.range)
+            return false;
+        int cell = unit.x * cols + unit.y;
+        if((heroes[cell / 64] | enemies[cell / 64]) >> (cell % 64) & 1)
+            return false;
+        enemies[cell / 64] |= 1ull << (cell % 64);
     }
-
-    void Buff(char type)
+    for(int w = 0; w < LevelSnapshot::WORDS; w++)
     {
-        switch (type) {
-        case 'm':
-            baseStats.move++;
-            break;
+        uint64_t inside = w * 64 >= cells ? 0 : cells - w * 64 >= 64 ? ~0ull : (1ull << (cells - w * 64)) - 1;
+        if((snapshot.planes[0][w] & ~inside) || (snapshot.planes[0][w] & (heroes[w] | enemies[w]))
+            || snapshot.planes[1][w] != heroes[w] || snapshot.planes[2][w] != enemies[w])
+            return false;
+    }
+    return true;
+}
+
+// Monsters of a level as columns (position, stats, kind) indexed by a
+// dense number 0..size()-1, plus a cell -> number lookup kept up to date
+// on every move and death, so range queries only touch the cells in
+// range. Death swap-removes in O(1); handles survive the renumbering.
+class Enemies
+{
+public:
+    void SetContext(GameContext& context)
+    {
+        this->context = &context;
+    }
+    void Resize(int rows, int cols)
+    {
+        this->rows = rows;
+        this->cols = cols;
+        occupant.assign(rows * cols, -1);
+    }
+    EnemyHandle Add(const Monster& monster)
+    {
+        int slot;
+        if(freeSlots.empty())
+        {
+            slot = int(denseOf.size());
+            denseOf.push_back(-1);
+            generations.push_back(0);
+        }
+        else
+        {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        int i = size();
+        denseOf[slot] = i;
+        slotOf.push_back(slot);
+        positions.push_back(monster.GetPos());
+        stats.push_back(monster.GetStats());
+        kinds.push_back(Kind(monster.GetName()));
+        occupant[Index(monster.GetPos())] = i;
+        maxRange = std::max(maxRange, monster.GetStats().range);
+        hash ^= Key(i);
+        return Handle(i);
+    }
+    // swap-remove, the last monster takes number i
+    void Remove(int i)
+    {
+        hash ^= Key(i);
+        occupant[Index(positions[i])] = -1;
+        int last = size() - 1;
+        int slot = slotOf[i];
+        generations[slot]++;
+        denseOf[slot] = -1;
+        freeSlots.push_back(slot);
+        if(i != last)
+        {
+            positions[i] = positions[last];
+            stats[i] = stats[last];
+            kinds[i] = kinds[last];
+            slotOf[i] = slotOf[last];
+            denseOf[slotOf[i]] = i;
+            occupant[Index(positions[i])] = i;
+        }
+        positions.pop_back();
+        stats.pop_back();
+        kinds.pop_back();
+        slotOf.pop_back();
+    }
+    void Remove(EnemyHandle handle)
+    {
+        int i = Find(handle);
+        if(i >= 0)
+            Remove(i);
+    }
+    EnemyHandle Handle(int i) const
+    {
+        return {slotOf[i], generations[slotOf[i]]};
+    }
+    // number of a living monster, -1 - dead or invalid handle
+    int Find(EnemyHandle handle) const
+    {
+        if(handle.slot < 0 || handle.slot >= int(denseOf.size())
+            || generations[handle.slot] != handle.generation)
+            return -1;
+        return denseOf[handle.slot];
+    }
+    // number of the monster on the cell, -1 - none
+    int At(coord pos) const
+    {
+        if(unsigned(pos.x) >= unsigned(rows) || unsigned(pos.y) >= unsigned(cols))
+            return -1;
+        return occupant[Index(pos)];
+    }
+    // calls f(monster number) for every monster within range of center
+    template<class F>
+    void ForEachInRange(coord center, int range, F f) const
+    {
+        for(const coord& offset : rangeOffsets(range))
+        {
+            int i = At(center + offset);
+            if(i >= 0)
+                f(i);
+        }
+    }
+    // the same from the enemy cells of the field the monsters stand on,
+    // one mask instead of a cell by cell look up where the field has it
+    template<class FieldT, class F>
+    void ForEachInRange(const FieldT& field, coord center, int range, F f) const
+    {
+        if(!field.HasRangeMask(range))
+            return ForEachInRange(center, range, f);
+        for(uint64_t b = field.Plane(cell::enemy)[0] & field.RangeMask(center, range); b; b &= b - 1)
+            f(occupant[lowestBit(b)]);
+    }
+    int MaxRange() const
+    {
+        return maxRange;
+    }
+
+    // Steps monster i down the flow field toward the hero until it is in
+    // range or out of movement, then moves it on the field.
+    void Move(int i, coord to, Field& field, const FlowField& flow)
+    {
+        PROFILE_SCOPE(monsterMove);
+        coord begin = positions[i];
+        coord pos = begin;
+        const Stats& stat = stats[i];
+        int speed = stat.move;
+        while(speed > 1)
+        {
+            // adjacent
+            if(lineOfSight(field, pos, to, stat.range))
+                break;
+            if(pos == to)
+            {
+                log(*context, "\tMonster don't move");
+                break;
+            }
+
+            coord best = pos;
+            int bestDistance = flow.Distance(pos);
+            int bestCost = 0;
+            for(const coord& step : FlowField::steps)
+            {
+                int cost = (step.x && step.y) ? 3 : 2;
+                coord next = pos + step;
+                if(cost > speed || !field.isFree(next))
+                    continue;
+                int distance = flow.Distance(next);
+                if(distance < bestDistance
+                    || (distance == bestDistance && bestCost && cost < bestCost))
+                {
+                    best = next;
+                    bestDistance = distance;
+                    bestCost = cost;
+                }
+            }
+            if(!bestCost)
+            {
+                PROFILE_COUNT(monsterDontKnow, 1);
+                log(*context, "\tMonster don't know");
+                break;
+            }
+            if(bestCost == 3)
+                log(*context, "\tMonster move diagonal");
+            else if(best.x != pos.x)
+                log(*context, "\tMonster move vertical");
+            else
+                log(*context, "\tMonster move horizontal");
+            pos = best;
+            speed -= bestCost;
+            PROFILE_COUNT(pathSteps, 1);
+            log(*context, "\t" + GetName(i) + " is at ", " ");
+            log(*context, pos);
+        }
+        if(pos == begin)
+            return;
+        field.Move(begin, pos);
+        hash ^= Key(i);
+        positions[i] = pos;
+        hash ^= Key(i);
+        occupant[Index(begin)] = -1;
+        occupant[Index(pos)] = i;
+    }
+    void Defend(int i, int attackDamage)
+    {
+        hash ^= Key(i);
+        defend(*context, stats[i], GetName(i), attackDamage);
+        hash ^= Key(i);
+    }
+    // false - more monsters than a snapshot holds
+    bool Save(LevelSnapshot& snapshot) const
+    {
+        if(size() > LevelSnapshot::MONSTERS || int(denseOf.size()) > LevelSnapshot::MONSTERS)
+            return false;
+        snapshot.monsterCount = uint8_t(size());
+        snapshot.slotCount = uint8_t(denseOf.size());
+        snapshot.enemiesHash = hash;
+        for(int i = 0; i < size(); i++)
+        {
+            LevelSnapshot::Unit& unit = snapshot.units[i];
+            unit.x = uint8_t(positions[i].x);
+            unit.y = uint8_t(positions[i].y);
+            unit.kind = uint8_t(kinds[i]);
+            unit.slot = uint8_t(slotOf[i]);
+            packStats(stats[i], unit.stats);
+        }
+        for(size_t slot = 0; slot < denseOf.size(); slot++)
+            snapshot.generations[slot] = generations[slot];
+        return true;
+    }
+    // reuses the columns, no allocation once they are big enough
+    void Restore(const LevelSnapshot& snapshot)
+    {
+        rows = snapshot.rows;
+        cols = snapshot.cols;
+        occupant.assign(rows * cols, -1);
+        positions.clear();
+        stats.clear();
+        kinds.clear();
+        slotOf.clear();
+        denseOf.assign(snapshot.slotCount, -1);
+        generations.assign(snapshot.generations, snapshot.generations + snapshot.slotCount);
+        maxRange = 0;
+        for(int i = 0; i < snapshot.monsterCount; i++)
+        {
+            const LevelSnapshot::Unit& unit = snapshot.units[i];
+            positions.push_back(coord(unit.x, unit.y));
+            stats.push_back(unpackStats(unit.stats));
+            kinds.push_back(unit.kind);
+            slotOf.push_back(unit.slot);
+            denseOf[unit.slot] = i;
+            occupant[Index(positions[i])] = i;
+            maxRange = std::max(maxRange, stats[i].range);
+            while(int(kindNames.size()) <= unit.kind)
+                kindNames.push_back("Monster");
+        }
+        freeSlots.clear();
+        for(int slot = snapshot.slotCount - 1; slot >= 0; slot--)
+            if(denseOf[slot] < 0)
+                freeSlots.push_back(slot);
+        hash = snapshot.enemiesHash;
+    }
+    // Zobrist hash of the monsters (cell and stats), kept up to date
+    uint64_t Hash() const
+    {
+        return hash;
+    }
+    void Print(int i) const
+    {
+        log(*context, GetName(i));
+        log<Stats>(*context, stats[i]);
+    }
+
+    coord GetPos(int i) const
+    {
+        return positions[i];
+    }
+    const Stats& GetStats(int i) const
+    {
+        return stats[i];
+    }
+    const std::string& GetName(int i) const
+    {
+        return kindNames[kinds[i]];
+    }
+    int size() const
+    {
+        return int(positions.size());
+    }
+    bool empty() const
+    {
+        return positions.empty();
+    }
+
+private:
+    int Index(coord pos) const
+    {
+        return pos.x * cols + pos.y;
+    }
+    uint64_t Key(int i) const
+    {
+        return zobristStats(stats[i], Index(positions[i]));
+    }
+    // kind id of the name, a new kind for a name not seen yet
+    int Kind(const std::string& name)
+    {
+        for(int k = 0; k < int(kindNames.size()); k++)
+            if(kindNames[k] == name)
+                return k;
+        kindNames.push_back(name);
+        return int(kindNames.size()) - 1;
+    }
+
+    GameContext* context = &quietContext();
+    int rows = 0, cols = 0;
+    int maxRange = 0;
+    uint64_t hash = 0;
+    // columns, by monster number
+    std::vector<coord> positions;
+    std::vector<Stats> stats;
+    std::vector<int> kinds;
+    std::vector<int> slotOf;
+    // by handle slot
+    std::vector<int> denseOf;
+    std::vector<uint32_t> generations;
+    std::vector<int> freeSlots;
+    // the archetypes first, so their kind is int(monster)
+    std::vector<std::string> kindNames = {"Spider", "Skeleton", "Minotaur", "Dragon"};
+    std::vector<int> occupant;
+};
+
+// The enemies turn against the hero on target: every monster steps along
+// the flow field, then those in range with a clear line attack. Returns
+// their summed attack.
+int enemiesAttack(const GameContext& context, Field& field, Enemies& enemies,
+                  FlowField& flow, coord target)
+{
+    flow.Build(field, target);
+    for(int i = 0; i < enemies.size(); i++)
+    {
+        TraceScope trace(context, "monster move", i);
+        enemies.Move(i, target, field, flow);
+    }
+    int attackDamage = 0;
+    enemies.ForEachInRange(field, target, enemies.MaxRange(), [&](int i) {
+        const Stats& stats = enemies.GetStats(i);
+        if(lineOfSight(field, enemies.GetPos(i), target, stats.range))
+        {
+            attackDamage += stats.attack;
+            log(context, enemies.GetName(i) + " attack");
+        }
+    });
+    return attackDamage;
+}
+
+class Hero;
+// Source of the hero decisions: dice assignment, movement keys,
+// attack target and the buff between levels.
+class Controller
+{
+public:
+    virtual ~Controller() = default;
+    // S/A/D (or 1/2/3) for die number index, anything else - auto set
+    virtual char ChooseDie(const Hero& hero, const Field& field, const Enemies& enemies,
+                           const std::vector<int>& dice, int index) = 0;
+    // numpad key (or WASD), anything else ends the move
+    virtual char ChooseMove(const Hero& hero, const Field& field) = 0;
+    // index in targets, out of range - first one
+    virtual int ChooseTarget(const Hero& hero, const Enemies& enemies,
+                             const std::vector<EnemyHandle>& targets) = 0;
+    // h(raise health to 6) or m/a/d/r
+    virtual char ChooseBuff(const Hero& hero) = 0;
+};
+Controller& terminalController();
+
+class Hero : public Character
+{
+public:
+    Hero(std::string name = "Hero")
+        :Hero(quietContext(), name)
+    {
+    }
+    Hero(GameContext& context, std::string name = "Hero")
+        :Character(name)
+    {
+//        baseStats = Stats(6, 1, 1, 1, 2);
+        this->context = &context;
+        controller = context.controller ? context.controller : &terminalController();
+    }
+
+    void SetController(Controller& newController)
+    {
+        controller = &newController;
+    }
+    Controller& GetController() const
+    {
+        return *controller;
+    }
+
+    void Buff(char type)
+    {
+        switch (type) {
+        case 'm':
+            baseStats.move++;
+            break;
         case 'a':
             baseStats.attack++;
             break;
@@ -615,33 +2391,42 @@ public:
             break;
         }
     }
+    const Stats& GetBaseStats() const
+    {
+        return baseStats;
+    }
+    void SetBaseStats(const Stats& stats)
+    {
+        baseStats = stats;
+    }
     void ResetStatsToBase()
     {
         int currHP = stats.health;
         stats = baseStats;
         stats.health = currHP;
     }
-    void RollDice(int count = 3)
+    void RollDice(const Field& field, const Enemies& enemies, int count = 3)
     {
-        std::vector<int> dies;
-        for(int i = 0; i < count; i++)
-        {
-            dies.push_back(rollDie());
-        }
-
+        std::vector<int> dies(count);
+        context->rng.RollDice(dies.data(), count);
+        AssignDice(field, enemies, dies);
+    }
+    // the controller sets the stats from a roll
+    void AssignDice(const Field& field, const Enemies& enemies, const std::vector<int>& dies)
+    {
+        int count = int(dies.size());
         ResetStatsToBase();
         PrintStats();
-        for(auto &die : dies)
+        for(int i = 0; i < count; i++)
         {
-            log(die, " ");
+            log(*context, dies[i], " ");
         }
-        log("\t: RNG");
+        log(*context, "\t: RNG");
 
         for(int i = 0; i < count; i++)
         {
-            log("Set " + std::to_string(i+1) +" die to S/A/D - Speed/Attack/Defence:", " ");
-            char choice;
-            std::cin >> choice;
+            log(*context, "Set " + std::to_string(i+1) +" die to S/A/D - Speed/Attack/Defence:", " ");
+            char choice = controller->ChooseDie(*this, field, enemies, dies, i);
             switch (choice) {
             case '1':
             case 'S':
@@ -659,7 +2444,7 @@ public:
                 stats.defence = baseStats.defence + dies.at(i);
                 break;
             default:
-                log("\t ... invalid, AUTO set");
+                log(*context, "\t ... invalid, AUTO set");
                 stats.move = baseStats.move + dies.at(0);
                 stats.attack = baseStats.attack + dies.at(1);
                 stats.defence = baseStats.defence + dies.at(2);
@@ -667,97 +2452,104 @@ public:
                 return;
             }
         }
-        log();
+        log(*context);
         PrintStats();
     }
-    void Move(Field& f)
+    // color - the level's map color, for the redraws after each step
+    void Move(Field& f, colorCode color = colorCode::normal)
     {
         while (stats.move > 1)
         {
-            coord posBegin = pos;
-            log("move left:", " ");
-            log(stats.move);
-            log("Numpad to move, 5 to stay");
-            char key;
-            std::cin >> key;
-            switch (key) {
-            case '1':
-                pos.y--;
-                pos.x++;
-                stats.move -= 3;
-                break;
-            case 's':
-            case 'S':
-            case '2':
-                pos.x++;
-                stats.move -= 2;
-                break;
-            case '3':
-                pos.y++;
-                pos.x++;
-                stats.move -= 3;
-                break;
-            case 'a':
-            case 'A':
-            case '4':
-                pos.y--;
-                stats.move -= 2;
-                break;
-            case 'd':
-            case 'D':
-            case '6':
-                pos.y++;
-                stats.move -= 2;
-                break;
-            case '7':
-                pos.y--;
-                pos.x--;
-                stats.move -= 3;
-                break;
-            case 'w':
-            case 'W':
-            case '8':
-                pos.x--;
-                stats.move -= 2;
-                break;
-            case '9':
-                pos.y++;
-                pos.x--;
-                stats.move -= 3;
-                break;
-            default:
-
+            log(*context, "move left:", " ");
+            log(*context, stats.move);
+            log(*context, "Numpad to move, 5 to stay");
+            if(!Step(f, controller->ChooseMove(*this, f), color))
                 return;
-            }
-            if(!f.Move(posBegin, pos))
-            {
-                pos = posBegin;
-                log("... out of map, sorry");
-            }
-            f.Print();
         }
     }
-
-    void Attack(std::vector<Monster>& enemies, Field& field)
+    // one move key: false - the key ends the move, otherwise the hero
+    // steps unless the cell is taken or off the map
+    bool Step(Field& f, char key, colorCode color = colorCode::normal)
     {
-        log("Hero Attack!", colorCode::cyan);
-        std::vector<Monster*> closeMonsters;
-        for(auto& monster : enemies)
+        coord posBegin = pos;
+        switch (key) {
+        case '1':
+            pos.y--;
+            pos.x++;
+            stats.move -= 3;
+            break;
+        case 's':
+        case 'S':
+        case '2':
+            pos.x++;
+            stats.move -= 2;
+            break;
+        case '3':
+            pos.y++;
+            pos.x++;
+            stats.move -= 3;
+            break;
+        case 'a':
+        case 'A':
+        case '4':
+            pos.y--;
+            stats.move -= 2;
+            break;
+        case 'd':
+        case 'D':
+        case '6':
+            pos.y++;
+            stats.move -= 2;
+            break;
+        case '7':
+            pos.y--;
+            pos.x--;
+            stats.move -= 3;
+            break;
+        case 'w':
+        case 'W':
+        case '8':
+            pos.x--;
+            stats.move -= 2;
+            break;
+        case '9':
+            pos.y++;
+            pos.x--;
+            stats.move -= 3;
+            break;
+        default:
+
+            return false;
+        }
+        if(f.isInside(pos) && !f.isFree(pos))
         {
-            if(monster.GetPos().isAdjacent(pos, stats.range))
-            {
-                log(monster.GetName(), "", colorCode::red);
-                log(" HP: " + std::to_string(monster.GetStats().health));
-                closeMonsters.push_back(&monster);
-            }
+            pos = posBegin;
+            log(*context, "... blocked, sorry");
+        }
+        else if(!f.Move(posBegin, pos))
+        {
+            pos = posBegin;
+            log(*context, "... out of map, sorry");
         }
-        Monster* attacked;
+        f.Print(*context, color);
+        return true;
+    }
+
+    void Attack(Enemies& enemies, Field& field)
+    {
+        log(*context, "Hero Attack!", colorCode::cyan);
+        std::vector<EnemyHandle> closeMonsters;
+        enemies.ForEachInRange(field, pos, stats.range, [&](int i) {
+            log(*context, enemies.GetName(i), "", colorCode::red);
+            log(*context, " HP: " + std::to_string(enemies.GetStats(i).health));
+            closeMonsters.push_back(enemies.Handle(i));
+        });
+        EnemyHandle attacked;
         if(closeMonsters.size() > 1)
         {
-            log("Choose monster to attack (0,1,..)");
-            int num;
-            std::cin >> num;
-            if(num < closeMonsters.size())
+            log(*context, "Choose monster to attack (0,1,..)");
+            int num = controller->ChooseTarget(*this, enemies, closeMonsters);
+            if(num >= 0 && num < int(closeMonsters.size()))
             {
                 attacked = closeMonsters.at(num);
             }
@@ -772,215 +2564,3781 @@ public:
         }
         else
         {
-            log("... nothing");
+            log(*context, "... nothing");
             return;
         }
 
-        attacked->Defend(stats.attack);
-        if(attacked->GetStats().health <= 0)
+        int i = enemies.Find(attacked);
+        enemies.Defend(i, stats.attack);
+        if(enemies.GetStats(i).health <= 0)
         {
-            for(int i = 0; i < enemies.size(); i++)
-            {
-                if(&enemies.at(i) == attacked)
-                {
-                    field.SetCell(enemies.at(i).GetPos(), cell::empty);
-                    enemies.erase(enemies.begin() + i);
-                }
-            }
+            field.SetCell(enemies.GetPos(i), cell::empty);
+            enemies.Remove(i);
         }
         else
         {
-            attacked->Print();
+            enemies.Print(i);
         }
 
     }
     void PrintStats() const
     {
-        log("Your stats: ");
-        log(stats.move, " ");
-        log(stats.attack, " ");
-        log(stats.defence, " ");
-        log(stats.range);
+        log(*context, "Your stats: ");
+        log(*context, stats.move, " ");
+        log(*context, stats.attack, " ");
+        log(*context, stats.defence, " ");
+        log(*context, stats.range);
     }
 private:
     Stats baseStats;
+    Controller* controller;
 };
 
-class Level
+// Numpad keys of the hero steps and where they lead.
+const char moveKeys[8] = {'1', '2', '3', '4', '6', '7', '8', '9'};
+const coord moveSteps[8] = {{1, -1}, {1, 0}, {1, 1}, {0, -1},
+                            {0, 1}, {-1, -1}, {-1, 0}, {-1, 1}};
+
+// Best use of a roll: the stat of every die (S/A/D), the turn that goes
+// with it and its value.
+struct DicePlan
+{
+    std::string assignment;
+    // numpad keys before and after the attack
+    std::string firstMoves, lastMoves;
+    EnemyHandle target;
+    double value = 0;
+};
+
+// Anything that picks a whole hero turn for a roll.
+class TurnPlanner
 {
 public:
-    Level(Hero& myHero, int number): id(number)
-    {
-        log("LEVEL " + std::to_string(id) + " create.", colorCode::green);
-        color = colorCode(id);
+    virtual ~TurnPlanner() = default;
+    virtual DicePlan Plan(const Hero& hero, const Field& field, const Enemies& enemies,
+                          const std::vector<int>& dice) = 0;
+};
 
-        coord begin(MAX_ROW-1, number%2 ? 0 : MAX_COL-1);
-        field.SetCell(begin, cell::hero);
-        hero = myHero;
-        hero.SetPosition(begin);
+// Dice assignment by expectimax. Every assignment of the roll is tried
+// with every hero turn it allows (cell to attack from, target, cell to
+// end on); the enemies turn that follows is played on a copy of the
+// level and the outcome scored. The enemies move deterministically, so
+// the only chance is in the rolls: looking depth turns ahead, each later
+// roll is averaged over all rolls, and positions already valued come
+// from a transposition table. The enemies answer to a hero cell is the
+// same whatever the dice, so it is simulated once per position.
+class DiceSolver : public TurnPlanner
+{
+public:
+    static constexpr double WIN = 1000;
+    static constexpr double LOSS = -1000;
+
+    DiceSolver(int depth = 1)
+        :depth(std::max(depth, 1)), plies(this->depth + 1), table(1 << 14)
+    {
+        quiet.traced = false;
     }
-    void Print() const
+
+    DicePlan Solve(const Hero& hero, const Field& field, const Enemies& enemies,
+                   const std::vector<int>& dice)
     {
-        log("LEVEL " + std::to_string(id) + " ready!", colorCode::green);
-        field.Print(color);
+        Begin(hero, field, enemies, dice);
+        Ply& root = plies[depth];
+        DicePlan plan;
+        plan.value = LOSS - 1;
+        Choice best;
+        ForEachAssignment(dice, [&](int code, int move, int attack, int defence) {
+            if(root.known[Key(move, attack, defence)])
+                return;
+            Turn(depth, move, attack, defence, [&](double value, const Choice& choice) {
+                if(value <= plan.value)
+                    return;
+                plan.value = value;
+                best = choice;
+                plan.assignment = Assignment(code, int(dice.size()));
+            });
+        });
+        if(best.first >= 0)
+            MakePlan(best, plan);
+        return plan;
     }
-    void HeroTurn()
+    DicePlan Plan(const Hero& hero, const Field& field, const Enemies& enemies,
+                  const std::vector<int>& dice) override
     {
-        log("Hero turn!", colorCode::cyan);
-        log("HP: " + std::to_string(hero.GetStats().health));
-        hero.RollDice();
-        hero.Move(field);
-        hero.Attack(enemies, field);
-        hero.Move(field);
+        return Solve(hero, field, enemies, dice);
     }
-    bool EnemiesTurn()
+
+    // up to limit best turns for the roll, one per outcome (stats, target
+    // and end cell), best first
+    void Candidates(const Hero& hero, const Field& field, const Enemies& enemies,
+                    const std::vector<int>& dice, size_t limit, std::vector<DicePlan>& plans)
     {
-        log();
-        log("Enemies turn!", colorCode::red);
-        for(auto &i : enemies)
+        Begin(hero, field, enemies, dice);
+        Ply& root = plies[depth];
+        int cells = field.Rows() * field.Cols();
+        struct Found
         {
-            coord pos = i.GetPos();
-            i.Move(hero.GetPos(), field);
-            field.Move(pos, i.GetPos());
+            double value;
+            int code;
+            Choice choice;
+        };
+        std::vector<Found> found;
+        // outcomes of the assignment by (target, end cell)
+        LazyIndex seen;
+        ForEachAssignment(dice, [&](int code, int move, int attack, int defence) {
+            if(root.known[Key(move, attack, defence)])
+                return;
+            seen.Clear();
+            Turn(depth, move, attack, defence, [&](double value, const Choice& choice) {
+                if(seen.FindOrAdd(uint64_t(choice.target + 1) * cells + choice.last, int(found.size())) < 0)
+                    found.push_back({value, code, choice});
+            });
+        });
+        std::stable_sort(found.begin(), found.end(), [](const Found& a, const Found& b) {
+            return a.value > b.value;
+        });
+        plans.clear();
+        for(size_t i = 0; i < found.size() && i < limit; i++)
+        {
+            plans.emplace_back();
+            plans.back().value = found[i].value;
+            plans.back().assignment = Assignment(found[i].code, int(dice.size()));
+            MakePlan(found[i].choice, plans.back());
         }
-        int attackDamage = 0;
-        for(auto &monster : enemies)
+    }
+
+private:
+    static constexpr int UNREACHED = -100;
+
+    struct Position
+    {
+        Field field;
+        Enemies enemies;
+        coord hero;
+        int health = 0;
+    };
+    // cells reachable with the move points left on arrival
+    struct Reach
+    {
+        std::vector<int> left;
+        std::vector<int> from;
+        std::vector<char> key;
+    };
+    // the enemies turn against the hero on one cell
+    struct Response
+    {
+        int attack = 0;
+        // flow distance of the closest enemy
+        int nearest = 0;
+        Field field;
+        Enemies enemies;
+    };
+    // ints by key, open addressed; a new generation empties it without
+    // touching the slots
+    class LazyIndex
+    {
+    public:
+        void Clear()
         {
-            if(monster.GetPos().isAdjacent(hero.GetPos(), monster.GetStats().range)
-                && lineOfSight(field, monster.GetPos(), hero.GetPos(), monster.GetStats().range))
+            used = 0;
+            if(++generation == 0)
             {
-                attackDamage += monster.GetStats().attack;
-                log(monster.GetName() + " attack");
+                std::fill(stamps.begin(), stamps.end(), 0);
+                generation = 1;
             }
         }
-        if(attackDamage)
+        // the value of key, or -1 after giving key the value
+        int FindOrAdd(uint64_t key, int value)
         {
-            log("Enemies attack is " + std::to_string(attackDamage), colorCode::red);
-            log("Hero defends is " + std::to_string(hero.GetStats().defence));
-            hero.Defend(attackDamage);
+            if(2 * (used + 1) > keys.size())
+                Grow();
+            size_t mask = keys.size() - 1;
+            for(size_t i = size_t(key * 0x9e3779b97f4a7c15ull >> 32) & mask; ; i = (i + 1) & mask)
+            {
+                if(stamps[i] != generation)
+                {
+                    stamps[i] = generation;
+                    keys[i] = key;
+                    values[i] = value;
+                    used++;
+                    return -1;
+                }
+                if(keys[i] == key)
+                    return values[i];
+            }
         }
-        if(hero.GetStats().health <= 0)
+
+    private:
+        void Grow()
         {
-            log("Game over!", colorCode::magenta);
-            return true;
+            size_t size = std::max<size_t>(keys.size() * 2, 256);
+            std::vector<uint64_t> oldKeys;
+            std::vector<uint32_t> oldStamps;
+            std::vector<int> oldValues;
+            oldKeys.swap(keys);
+            oldStamps.swap(stamps);
+            oldValues.swap(values);
+            keys.assign(size, 0);
+            stamps.assign(size, 0);
+            values.assign(size, 0);
+            used = 0;
+            for(size_t i = 0; i < oldKeys.size(); i++)
+                if(oldStamps[i] == generation)
+                    FindOrAdd(oldKeys[i], oldValues[i]);
         }
-        return false;
-    }
 
-    void AddWall(coord pos)
+        std::vector<uint64_t> keys;
+        std::vector<uint32_t> stamps;
+        std::vector<int> values;
+        size_t used = 0;
+        uint32_t generation = 1;
+    };
+    // a position being searched and its parts that do not depend on the roll
+    struct Ply
     {
-        field.AddWall(pos);
+        Position position;
+        // the field without the hero, and without the killed enemy
+        Field open, cleared;
+        int clearedEnemy = -1;
+        int enemyHealth = 0;
+        int span = 0;
+        // reaches and responses are made the first time a turn asks for
+        // them and looked up by (killed enemy, cell[, move left]): a big
+        // map with many enemies has far too many to lay out in advance
+        std::vector<int> firstReach;
+        LazyIndex lastReach;
+        std::deque<Reach> reaches;
+        int reachesUsed = 0;
+        LazyIndex responseIndex;
+        std::deque<Response> responses;
+        int responsesUsed = 0;
+        // turn value by die on S/A/D, 0..6 each (0 - base stat)
+        std::vector<char> known;
+        std::vector<double> values;
+        std::vector<int> targets;
+    };
+    struct Choice
+    {
+        int first = -1, target = -1, last = -1;
+        int firstReach = -1, lastReach = -1;
+    };
+    struct Roll
+    {
+        std::vector<int> dice;
+        double chance;
+    };
+    struct Entry
+    {
+        uint64_t key = 0;
+        double value = 0;
+    };
+
+    void Begin(const Hero& hero, const Field& field, const Enemies& enemies,
+               const std::vector<int>& dice)
+    {
+        base = hero.GetBaseStats();
+        if(rolls.empty() || int(rolls.front().dice.size()) != int(dice.size()))
+            BuildRolls(int(dice.size()));
+
+        Ply& root = plies[depth];
+        root.position.field = field;
+        root.position.enemies = enemies;
+        root.position.enemies.SetContext(quiet);
+        root.position.hero = hero.GetPos();
+        root.position.health = hero.GetStats().health;
+        Prepare(depth);
     }
-    void AddEnemy(std::string name, Stats stats, coord pos)
+    static std::string Assignment(int code, int count)
     {
-        field.SetCell(pos, cell::enemy);
-        enemies.push_back(Monster(name, stats, pos));
+        std::string letters;
+        for(int i = 0; i < count; i++, code /= 3)
+            letters += "SAD"[code % 3];
+        return letters;
     }
-    void AddEnemy(monster type, coord pos)
+    // moves and target of a turn of the root position
+    void MakePlan(const Choice& choice, DicePlan& plan)
     {
-        field.SetCell(pos, cell::enemy);
-        enemies.push_back(Monster(type, pos));
+        Ply& root = plies[depth];
+        plan.firstMoves = Path(root.reaches[choice.firstReach], choice.first);
+        plan.lastMoves.clear();
+        if(choice.lastReach >= 0)
+            plan.lastMoves = Path(root.reaches[choice.lastReach], choice.last);
+        plan.target = EnemyHandle();
+        if(choice.target >= 0)
+            plan.target = root.position.enemies.Handle(choice.target);
     }
-    void PrintEnemies() const
+
+    static int Key(int move, int attack, int defence)
     {
-        for(int id = 0; id < enemies.size(); id++)
-        {
-            log(id, " ");
-            enemies.at(id).Print();
-        }
+        return (move * 7 + attack) * 7 + defence;
     }
-    bool isClear() const
+
+    // calls f(code, die on S, die on A, die on D) for every way to give
+    // the dice to the stats, die i on stat code / 3^i % 3. With up to
+    // three dice no stat takes two, the second would only overwrite.
+    template<class F>
+    static void ForEachAssignment(const std::vector<int>& dice, F f)
+    {
+        int count = int(dice.size());
+        int ways = 1;
+        for(int i = 0; i < count; i++)
+            ways *= 3;
+        for(int code = 0; code < ways; code++)
+        {
+            int die[3] = {0, 0, 0};
+            bool twice = false;
+            for(int i = 0, c = code; i < count; i++, c /= 3)
+            {
+                twice |= count <= 3 && die[c % 3];
+                die[c % 3] = dice[i];
+            }
+            if(!twice)
+                f(code, die[0], die[1], die[2]);
+        }
+    }
+
+    // every roll of count dice in ascending order with its chance
+    void BuildRolls(int count)
+    {
+        rolls.clear();
+        std::vector<int> dice(count, 1);
+        double total = 1;
+        for(int i = 0; i < count; i++)
+            total *= 6;
+        while(true)
+        {
+            // orderings of the roll: count! / (repeats)!
+            double orders = 1;
+            for(int i = 1, run = 1; i <= count; i++)
+            {
+                orders *= i;
+                run = (i < count && dice[i] == dice[i - 1]) ? run + 1 : 1;
+                if(run > 1)
+                    orders /= run;
+            }
+            rolls.push_back({dice, orders / total});
+            int i = count - 1;
+            while(i >= 0 && dice[i] == 6)
+                i--;
+            if(i < 0)
+                break;
+            dice[i]++;
+            for(int j = i + 1; j < count; j++)
+                dice[j] = dice[i];
+        }
+    }
+
+    void Prepare(int remaining)
+    {
+        Ply& ply = plies[remaining];
+        const Position& position = ply.position;
+        ply.open = position.field;
+        ply.open.SetCell(position.hero, cell::empty);
+        ply.clearedEnemy = -1;
+        ply.enemyHealth = 0;
+        for(int i = 0; i < position.enemies.size(); i++)
+            ply.enemyHealth += position.enemies.GetStats(i).health;
+        // move points: base + one die, and -1 after a diagonal step on 2
+        ply.span = base.move + 6 + 2;
+        ply.firstReach.assign(ply.span, -1);
+        ply.lastReach.Clear();
+        ply.reachesUsed = 0;
+        ply.responseIndex.Clear();
+        ply.responsesUsed = 0;
+        ply.known.assign(7 * 7 * 7, 0);
+        ply.values.resize(7 * 7 * 7);
+    }
+
+    Reach& NewReach(Ply& ply)
+    {
+        if(ply.reachesUsed == int(ply.reaches.size()))
+            ply.reaches.emplace_back();
+        return ply.reaches[ply.reachesUsed++];
+    }
+    // hero steps as in Hero::Move: any step while more than 1 point is left
+    void Walk(const Field& field, coord from, int points, Reach& reach)
+    {
+        int cells = field.Rows() * field.Cols();
+        reach.left.assign(cells, UNREACHED);
+        reach.from.assign(cells, -1);
+        reach.key.assign(cells, '5');
+        reach.left[field.Index(from)] = points;
+        stack.assign(1, field.Index(from));
+        while(!stack.empty())
+        {
+            int index = stack.back();
+            stack.pop_back();
+            int left = reach.left[index];
+            if(left <= 1)
+                continue;
+            coord pos = field.Pos(index);
+            for(int s = 0; s < 8; s++)
+            {
+                coord next = pos + moveSteps[s];
+                if(!field.isFree(next))
+                    continue;
+                int cost = (moveSteps[s].x && moveSteps[s].y) ? 3 : 2;
+                int nextIndex = field.Index(next);
+                if(left - cost > reach.left[nextIndex])
+                {
+                    reach.left[nextIndex] = left - cost;
+                    reach.from[nextIndex] = index;
+                    reach.key[nextIndex] = moveKeys[s];
+                    stack.push_back(nextIndex);
+                }
+            }
+        }
+    }
+    int FirstReach(Ply& ply, int move)
+    {
+        int& index = ply.firstReach[move];
+        if(index < 0)
+        {
+            index = ply.reachesUsed;
+            Walk(ply.open, ply.position.hero, move, NewReach(ply));
+        }
+        return index;
+    }
+    int LastReach(Ply& ply, int cell, int left, int killed)
+    {
+        int cells = ply.open.Rows() * ply.open.Cols();
+        int index = ply.lastReach.FindOrAdd((uint64_t(killed + 1) * cells + cell) * ply.span + left + 1,
+                                            ply.reachesUsed);
+        if(index < 0)
+        {
+            index = ply.reachesUsed;
+            Reach& reach = NewReach(ply);
+            if(killed < 0)
+            {
+                Walk(ply.open, ply.open.Pos(cell), left, reach);
+            }
+            else
+            {
+                if(ply.clearedEnemy != killed)
+                {
+                    ply.cleared = ply.open;
+                    ply.cleared.SetCell(ply.position.enemies.GetPos(killed), cell::empty);
+                    ply.clearedEnemy = killed;
+                }
+                Walk(ply.cleared, ply.open.Pos(cell), left, reach);
+            }
+        }
+        return index;
+    }
+    const Response& Respond(Ply& ply, int cell, int killed)
+    {
+        int cells = ply.position.field.Rows() * ply.position.field.Cols();
+        int index = ply.responseIndex.FindOrAdd(uint64_t(killed + 1) * cells + cell, ply.responsesUsed);
+        if(index >= 0)
+            return ply.responses[index];
+        if(ply.responsesUsed == int(ply.responses.size()))
+            ply.responses.emplace_back();
+        Response& response = ply.responses[ply.responsesUsed++];
+        response.field = ply.open;
+        response.enemies = ply.position.enemies;
+        response.enemies.SetContext(quiet);
+        if(killed >= 0)
+        {
+            response.field.SetCell(response.enemies.GetPos(killed), cell::empty);
+            response.enemies.Remove(killed);
+        }
+        coord hero = ply.open.Pos(cell);
+        response.field.SetCell(hero, cell::hero);
+        response.attack = enemiesAttack(quiet, response.field, response.enemies, flow, hero);
+        response.nearest = FlowField::unreachable;
+        for(int i = 0; i < response.enemies.size(); i++)
+            response.nearest = std::min(response.nearest, flow.Distance(response.enemies.GetPos(i)));
+        return response;
+    }
+
+    // value of the best turn with the stats base + dice, every turn
+    // tried goes to visit(value, choice)
+    template<class F>
+    double Turn(int remaining, int moveDie, int attackDie, int defenceDie, F visit)
+    {
+        Ply& ply = plies[remaining];
+        int move = base.move + moveDie;
+        int attack = base.attack + attackDie;
+        int defence = base.defence + defenceDie;
+        int cells = ply.position.field.Rows() * ply.position.field.Cols();
+        int first = FirstReach(ply, move);
+        double best = LOSS - 1;
+        for(int from = 0; from < cells; from++)
+        {
+            int left = ply.reaches[first].left[from];
+            if(left == UNREACHED)
+                continue;
+            const Enemies& enemies = ply.position.enemies;
+            ply.targets.clear();
+            enemies.ForEachInRange(ply.open, ply.open.Pos(from), base.range, [&](int i) {
+                ply.targets.push_back(i);
+            });
+            int options = std::max(1, int(ply.targets.size()));
+            for(int o = 0; o < options; o++)
+            {
+                int target = ply.targets.empty() ? -1 : ply.targets[o];
+                int damage = 0;
+                int killed = -1;
+                if(target >= 0)
+                {
+                    const Stats& stats = enemies.GetStats(target);
+                    damage = attack / stats.defence;
+                    if(stats.health - damage <= 0)
+                        killed = target;
+                }
+                if(killed >= 0 && enemies.size() == 1)
+                {
+                    double value = WIN + 10 * ply.position.health;
+                    best = std::max(best, value);
+                    visit(value, Choice{from, target, from, first, -1});
+                    continue;
+                }
+                int last = LastReach(ply, from, left, killed);
+                for(int to = 0; to < cells; to++)
+                {
+                    if(ply.reaches[last].left[to] == UNREACHED)
+                        continue;
+                    double value = Outcome(remaining, to, target, killed, attack, damage, defence);
+                    best = std::max(best, value);
+                    visit(value, Choice{from, target, to, first, last});
+                }
+            }
+        }
+        ply.known[Key(moveDie, attackDie, defenceDie)] = 1;
+        ply.values[Key(moveDie, attackDie, defenceDie)] = best;
+        return best;
+    }
+
+    double Outcome(int remaining, int to, int target, int killed, int attack, int damage, int defence)
+    {
+        Ply& ply = plies[remaining];
+        const Response& response = Respond(ply, to, killed);
+        int health = ply.position.health - response.attack / defence;
+        if(health <= 0)
+            return LOSS;
+        int enemyHealth = ply.enemyHealth;
+        if(target >= 0)
+            enemyHealth -= killed >= 0 ? ply.position.enemies.GetStats(target).health : damage;
+        if(remaining == 1)
+            return 10 * health - 4 * enemyHealth - 0.5 * response.nearest;
+
+        Position& child = plies[remaining - 1].position;
+        child.field = response.field;
+        child.enemies = response.enemies;
+        if(target >= 0 && killed < 0)
+            child.enemies.Defend(target, attack);
+        child.hero = ply.open.Pos(to);
+        child.health = health;
+        return Expected(remaining - 1);
+    }
+
+    // value of plies[remaining] before its roll
+    double Expected(int remaining)
+    {
+        Ply& ply = plies[remaining];
+        uint64_t key = Hash(ply.position, remaining);
+        Entry& entry = table[key & (table.size() - 1)];
+        if(entry.key == key)
+            return entry.value;
+
+        Prepare(remaining);
+        double expected = 0;
+        for(const Roll& roll : rolls)
+        {
+            double best = LOSS - 1;
+            ForEachAssignment(roll.dice, [&](int, int move, int attack, int defence) {
+                int k = Key(move, attack, defence);
+                double value = ply.known[k] ? ply.values[k]
+                                            : Turn(remaining, move, attack, defence,
+                                                   [](double, const Choice&) {});
+                best = std::max(best, value);
+            });
+            expected += roll.chance * best;
+        }
+        entry.key = key;
+        entry.value = expected;
+        return expected;
+    }
+
+    uint64_t Hash(const Position& position, int remaining) const
+    {
+        Stats hero = base;
+        hero.health = position.health;
+        uint64_t shape = uint64_t(remaining) << 32 | uint64_t(position.field.Rows()) << 16
+                         | uint64_t(position.field.Cols());
+        return (position.field.Hash() ^ position.enemies.Hash() ^ zobristStats(hero)
+                ^ zobrist(uint64_t(5) << 56 | shape)) | 1;
+    }
+
+    // keys of the steps from the start of reach to cell
+    static std::string Path(const Reach& reach, int cell)
+    {
+        std::string keys;
+        for(int at = cell; reach.from[at] >= 0; at = reach.from[at])
+            keys += reach.key[at];
+        std::reverse(keys.begin(), keys.end());
+        return keys;
+    }
+
+    int depth;
+    Stats base;
+    GameContext quiet;
+    FlowField flow;
+    std::vector<int> stack;
+    std::vector<Roll> rolls;
+    // by turns left to look ahead
+    std::vector<Ply> plies;
+    std::vector<Entry> table;
+};
+
+// Auto play with a planner: it plans the turn once the dice are rolled,
+// then walks and attacks as planned.
+class PlanController : public Controller
+{
+public:
+    PlanController(TurnPlanner& planner): planner(planner) {}
+
+    char ChooseDie(const Hero& hero, const Field& field, const Enemies& enemies,
+                   const std::vector<int>& dice, int index) override
+    {
+        if(index == 0)
+        {
+            plan = planner.Plan(hero, field, enemies, dice);
+            firstStep = lastStep = 0;
+            attacked = false;
+        }
+        return index < int(plan.assignment.size()) ? plan.assignment[index] : 0;
+    }
+    char ChooseMove(const Hero&, const Field&) override
+    {
+        if(firstStep < plan.firstMoves.size())
+            return plan.firstMoves[firstStep++];
+        if(!attacked)
+        {
+            attacked = true;
+            return '5';
+        }
+        if(lastStep < plan.lastMoves.size())
+            return plan.lastMoves[lastStep++];
+        return '5';
+    }
+    int ChooseTarget(const Hero&, const Enemies&, const std::vector<EnemyHandle>& targets) override
+    {
+        for(int i = 0; i < int(targets.size()); i++)
+            if(targets[i].slot == plan.target.slot && targets[i].generation == plan.target.generation)
+                return i;
+        return 0;
+    }
+    char ChooseBuff(const Hero&) override
+    {
+        return 'h';
+    }
+
+private:
+    TurnPlanner& planner;
+    DicePlan plan;
+    size_t firstStep = 0, lastStep = 0;
+    bool attacked = false;
+};
+
+// Reads the decisions from a stream, the same keys a player types.
+class StreamController : public Controller
+{
+public:
+    StreamController(std::istream& input): in(input) {}
+
+    // shows the solver's assignment before the first die is read
+    void ShowHints(DiceSolver* solver)
+    {
+        hints = solver;
+    }
+    char ChooseDie(const Hero& hero, const Field& field, const Enemies& enemies,
+                   const std::vector<int>& dice, int index) override
+    {
+        if(hints && index == 0)
+            log(hero.Context(), "(hint: " + hints->Solve(hero, field, enemies, dice).assignment + ")",
+                " ", colorCode::yellow);
+        return ReadChar(hero);
+    }
+    char ChooseMove(const Hero& hero, const Field&) override
+    {
+        return ReadChar(hero);
+    }
+    int ChooseTarget(const Hero& hero, const Enemies&, const std::vector<EnemyHandle>&) override
+    {
+        int num = 0;
+        Sync(hero);
+        in >> num;
+        return num;
+    }
+    char ChooseBuff(const Hero& hero) override
+    {
+        return ReadChar(hero);
+    }
+
+private:
+    // the prompt is on screen before the input is read
+    static void Sync(const Hero& hero)
+    {
+        if(hero.Context().sink)
+            hero.Context().sink->Sync();
+    }
+    char ReadChar(const Hero& hero)
+    {
+        char c = 0;
+        Sync(hero);
+        in >> c;
+        return c;
+    }
+    std::istream& in;
+    DiceSolver* hints = nullptr;
+};
+
+class TerminalController : public StreamController
+{
+public:
+    TerminalController(): StreamController(std::cin) {}
+};
+Controller& terminalController()
+{
+    static TerminalController terminal;
+    return terminal;
+}
+
+// Scripted input file, once it runs out every decision falls back to auto.
+class ScriptController : public StreamController
+{
+public:
+    ScriptController(const GameContext& context, const std::string& path)
+        :StreamController(file), file(path)
+    {
+        if(!file)
+            log(context, "Can not open script " + path, colorCode::red);
+    }
+
+private:
+    std::ifstream file;
+};
+
+// Headless move: step toward the closest enemy, stay once it is in range.
+char autoMoveKey(const Hero& hero, const Field& f)
+{
+    coord pos = hero.GetPos();
+    Stats stats = hero.GetStats();
+    coord target;
+    int closest = -1;
+    f.ForEachCell(cell::enemy, [&](coord enemy) {
+        if(closest < 0 || pos.distance2(enemy) < closest)
+        {
+            target = enemy;
+            closest = pos.distance2(target);
+        }
+    });
+    if(closest < 0 || pos.isAdjacent(target, stats.range))
+        return '5';
+
+    char best = '5';
+    for(int i = 0; i < 8; i++)
+    {
+        int cost = (moveSteps[i].x && moveSteps[i].y) ? 3 : 2;
+        coord next = pos + moveSteps[i];
+        if(cost <= stats.move && f.isFree(next)
+            && next.distance2(target) < closest)
+        {
+            closest = next.distance2(target);
+            best = moveKeys[i];
+        }
+    }
+    return best;
+}
+
+// In-process policy: plain callbacks, no stream parsing.
+// Unset callbacks use the auto policy.
+class PolicyController : public Controller
+{
+public:
+    std::function<char(const Hero&, const Field&, const Enemies&, const std::vector<int>&, int)> die;
+    std::function<char(const Hero&, const Field&)> move = autoMoveKey;
+    std::function<int(const Hero&, const Enemies&, const std::vector<EnemyHandle>&)> target;
+    std::function<char(const Hero&)> buff;
+
+    char ChooseDie(const Hero& hero, const Field& field, const Enemies& enemies,
+                   const std::vector<int>& dice, int index) override
+    {
+        return die ? die(hero, field, enemies, dice, index) : 0;
+    }
+    char ChooseMove(const Hero& hero, const Field& field) override
+    {
+        return move ? move(hero, field) : '5';
+    }
+    int ChooseTarget(const Hero& hero, const Enemies& enemies,
+                     const std::vector<EnemyHandle>& targets) override
+    {
+        return target ? target(hero, enemies, targets) : 0;
+    }
+    char ChooseBuff(const Hero& hero) override
+    {
+        return buff ? buff(hero) : 'h';
+    }
+};
+
+// hero start of a level without an explicit one
+coord startCorner(int number, int rows, int cols)
+{
+    return coord(rows-1, number%2 ? 0 : cols-1);
+}
+
+// Plain description of a level, the input of the level pack writer.
+struct LevelSpec
+{
+    int id = 1;
+    int rows = DEFAULT_ROWS;
+    int cols = DEFAULT_COLS;
+    coord start = startCorner(1, DEFAULT_ROWS, DEFAULT_COLS);
+    std::vector<coord> walls;
+    std::vector<std::pair<monster, coord>> enemies;
+    // Zobrist hash of the layout (cells and monster kinds), 0 - not set
+    uint64_t hash = 0;
+};
+
+class Level
+{
+public:
+    Level(const Hero& myHero, int number, int rows = DEFAULT_ROWS, int cols = DEFAULT_COLS)
+        :Level(myHero, number, rows, cols, startCorner(number, rows, cols))
+    {
+    }
+    Level(const Hero& myHero, int number, int rows, int cols, coord begin)
+        :context(&myHero.Context()), id(number), field(rows, cols)
+    {
+        log(*context, "LEVEL " + std::to_string(id) + " create.", colorCode::green);
+        color = colorCode(1 + abs(id - 1) % 7);
+
+        enemies.SetContext(*context);
+        enemies.Resize(rows, cols);
+        field.SetCell(begin, cell::hero);
+        hero = myHero;
+        hero.SetPosition(begin);
+    }
+    // a level in the middle of play, as the hero sees it
+    Level(const Hero& myHero, const Field& layout, const Enemies& monsters)
+        :context(&myHero.Context()), id(0), color(colorCode::normal),
+         field(layout), hero(myHero), enemies(monsters)
+    {
+    }
+    // a saved level for this hero
+    Level(const Hero& myHero, const LevelSnapshot& snapshot)
+        :context(&myHero.Context()), hero(myHero)
+    {
+        enemies.SetContext(*context);
+        Restore(snapshot);
+    }
+    void SetContext(GameContext& newContext)
+    {
+        context = &newContext;
+        hero.SetContext(newContext);
+        enemies.SetContext(newContext);
+    }
+    // false - the level is too big for a snapshot
+    bool Save(LevelSnapshot& snapshot) const
+    {
+        std::memset(&snapshot, 0, sizeof(snapshot));
+        if(field.Words() > LevelSnapshot::WORDS || field.Rows() > 255 || field.Cols() > 255)
+            return false;
+        snapshot.id = id;
+        snapshot.rows = uint8_t(field.Rows());
+        snapshot.cols = uint8_t(field.Cols());
+        snapshot.heroX = uint8_t(hero.GetPos().x);
+        snapshot.heroY = uint8_t(hero.GetPos().y);
+        packStats(hero.GetStats(), snapshot.hero);
+        packStats(hero.GetBaseStats(), snapshot.heroBase);
+        snapshot.fieldHash = field.Hash();
+        for(cell type : {cell::wall, cell::hero, cell::enemy})
+            std::memcpy(snapshot.planes[int(type) - 1], field.Plane(type), field.Words() * sizeof(uint64_t));
+        return enemies.Save(snapshot);
+    }
+    // back to a saved state; the hero keeps its name, controller and context
+    void Restore(const LevelSnapshot& snapshot)
+    {
+        id = snapshot.id;
+        color = colorCode(1 + abs(id - 1) % 7);
+        if(field.Rows() != snapshot.rows || field.Cols() != snapshot.cols)
+            field = Field(snapshot.rows, snapshot.cols);
+        field.SetPlanes(snapshot.planes[0], snapshot.planes[1], snapshot.planes[2], snapshot.fieldHash);
+        hero.SetPosition(snapshot.heroX, snapshot.heroY);
+        hero.SetStats(unpackStats(snapshot.hero));
+        hero.SetBaseStats(unpackStats(snapshot.heroBase));
+        enemies.Restore(snapshot);
+    }
+    void Print() const
+    {
+        log(*context, "LEVEL " + std::to_string(id) + " ready!", colorCode::green);
+        field.Print(*context, color);
+    }
+    void HeroTurn()
+    {
+        PROFILE_SCOPE(heroTurn);
+        log(*context, "Hero turn!", colorCode::cyan);
+        log(*context, "HP: " + std::to_string(hero.GetStats().health));
+        {
+            TraceScope trace(*context, "roll");
+            hero.RollDice(field, enemies);
+        }
+        HeroActions();
+    }
+    // the hero turn for a roll already made
+    void HeroTurn(const std::vector<int>& dice)
+    {
+        PROFILE_SCOPE(heroTurn);
+        {
+            TraceScope trace(*context, "roll");
+            hero.AssignDice(field, enemies, dice);
+        }
+        HeroActions();
+    }
+    // The hero turn a decision at a time, for callers that drive it
+    // themselves: AssignDice, HeroStep until the move is over,
+    // HeroAttack, HeroStep again.
+    void AssignDice(const std::vector<int>& dice)
+    {
+        hero.AssignDice(field, enemies, dice);
+    }
+    // false - the key ends the move or no movement is left
+    bool HeroStep(char key)
+    {
+        return hero.GetStats().move > 1 && hero.Step(field, key, color);
+    }
+    // monsters the hero can attack from where it stands
+    int HeroTargets() const
+    {
+        int count = 0;
+        enemies.ForEachInRange(field, hero.GetPos(), hero.GetStats().range, [&](int) {
+            count++;
+        });
+        return count;
+    }
+    void HeroAttack()
+    {
+        hero.Attack(enemies, field);
+    }
+    bool EnemiesTurn()
+    {
+        PROFILE_SCOPE(enemiesTurn);
+        TraceScope trace(*context, "enemies turn");
+        log(*context);
+        log(*context, "Enemies turn!", colorCode::red);
+        int attackDamage = enemiesAttack(*context, field, enemies, flow, hero.GetPos());
+        if(attackDamage)
+        {
+            log(*context, "Enemies attack is " + std::to_string(attackDamage), colorCode::red);
+            log(*context, "Hero defends is " + std::to_string(hero.GetStats().defence));
+            hero.Defend(attackDamage);
+        }
+        if(hero.GetStats().health <= 0)
+        {
+            log(*context, "Game over!", colorCode::magenta);
+            return true;
+        }
+        return false;
+    }
+
+    Level(const Hero& myHero, const LevelSpec& spec)
+        :Level(myHero, spec.id, spec.rows, spec.cols, spec.start)
+    {
+        for(const coord& wall : spec.walls)
+            AddWall(wall);
+        for(const auto& enemy : spec.enemies)
+            AddEnemy(enemy.first, enemy.second);
+    }
+
+    void AddWall(coord pos)
+    {
+        field.AddWall(pos);
+    }
+    // whole wall plane at once, see Field::SetWalls
+    void SetWalls(const void* words)
+    {
+        field.SetWalls(words);
+    }
+    void AddEnemy(std::string name, Stats stats, coord pos)
+    {
+        field.SetCell(pos, cell::enemy);
+        enemies.Add(Monster(name, stats, pos));
+    }
+    void AddEnemy(monster type, coord pos)
+    {
+        field.SetCell(pos, cell::enemy);
+        enemies.Add(Monster(type, pos));
+    }
+    void PrintEnemies() const
+    {
+        for(int id = 0; id < enemies.size(); id++)
+        {
+            log(*context, id, " ");
+            enemies.Print(id);
+        }
+    }
+    bool isClear() const
     {
         if(enemies.empty())
         {
-            log("^^ You WIN! ^^", colorCode::green);
-            return true;
+            log(*context, "^^ You WIN! ^^", colorCode::green);
+            return true;
+        }
+        return false;
+    }
+
+    const Field& GetField() const {return field;}
+    Hero& GetHero() {return hero;}
+    const Hero& GetHero() const {return hero;}
+    const Enemies& GetEnemies() const {return enemies;}
+    // Zobrist hash of the whole state: cells, monsters and hero stats
+    uint64_t Hash() const
+    {
+        return field.Hash() ^ enemies.Hash() ^ zobristStats(hero.GetStats());
+    }
+    colorCode GetColor() {return color;}
+    int GetId() const {return id;}
+    GameContext& Context() const {return *context;}
+
+private:
+    void HeroActions()
+    {
+        {
+            TraceScope trace(*context, "move");
+            hero.Move(field, color);
+        }
+        {
+            TraceScope trace(*context, "attack");
+            hero.Attack(enemies, field);
+        }
+        TraceScope trace(*context, "move");
+        hero.Move(field, color);
+    }
+
+    GameContext* context;
+    int id;
+    colorCode color;
+    Field field;
+    Hero hero;
+    Enemies enemies;
+    FlowField flow;
+
+};
+
+std::vector<LevelSpec> campaignSpecs()
+{
+    std::vector<LevelSpec> specs(4);
+    for(int i = 0; i < 4; i++)
+    {
+        specs[i].id = i + 1;
+        specs[i].start = startCorner(i + 1, DEFAULT_ROWS, DEFAULT_COLS);
+    }
+    specs[0].walls = {{1, 3}, {3, 3}, {3, 1}};
+    specs[0].enemies = {{monster::spider, {0, 3}}, {monster::spider, {2, 4}}};
+
+    specs[1].walls = {{2, 3}, {3, 3}, {3, 0}};
+    specs[1].enemies = {{monster::skeletonArcher, {1, 0}}, {monster::skeletonArcher, {0, 2}}};
+
+    specs[2].walls = {{3, 1}, {1, 1}, {1, 3}};
+    specs[2].enemies = {{monster::minotaur, {1, 4}}};
+
+    specs[3].walls = {{1, 1}, {2, 1}, {2, 4}};
+    specs[3].enemies = {{monster::dragon, {0, 1}}};
+    return specs;
+}
+
+void BuildCampaign(std::vector<Level>& levels, Hero& adventurer)
+{
+    for(const LevelSpec& spec : campaignSpecs())
+    {
+        levels.push_back(Level(adventurer, spec));
+        if(levels.size() == 1)
+        {
+            adventurer.SetStat('h', 5);
+            adventurer.Buff('a');
+        }
+    }
+}
+
+// Whole hero turn planner by Monte Carlo tree search. The threads share
+// one tree: a decision node is a position with its roll, its edges the
+// solver's best turns for that roll, opened one by one as the node gets
+// visits (progressive widening); the roll after a turn and the enemies
+// answer is a chance node. A playout restores the level from a snapshot
+// (no allocation), follows the tree by UCT, adds one node, plays on with
+// the one turn solver up to the horizon and scores the result. Going
+// down an edge counts the visit at once with no reward yet (virtual
+// loss), so concurrent playouts spread over different turns.
+class MctsPlanner : public TurnPlanner
+{
+public:
+    MctsPlanner(int budgetMs = 50, int threads = 0, int horizon = 4)
+        :budget(budgetMs), horizon(std::max(horizon, 1))
+    {
+        if(threads <= 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for(int t = 0; t < threads; t++)
+            walkers.emplace_back(new Walker(*this, seeds.Next()));
+    }
+
+    DicePlan Plan(const Hero& hero, const Field& field, const Enemies& enemies,
+                  const std::vector<int>& dice) override
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::milliseconds(budget);
+        std::vector<int> sorted(dice);
+        std::sort(sorted.begin(), sorted.end());
+        Level level(hero, field, enemies);
+        LevelSnapshot snapshot;
+        const LevelSnapshot* compact = level.Save(snapshot) ? &snapshot : nullptr;
+        int enemyHealth = 0;
+        for(int i = 0; i < enemies.size(); i++)
+            enemyHealth += enemies.GetStats(i).health;
+        std::unique_ptr<Decision> root(Expand(walkers[0]->solver, hero, field, enemies, sorted));
+
+        std::atomic<long long> count{0};
+        auto work = [&](int t) {
+            while(std::chrono::steady_clock::now() < deadline)
+            {
+                walkers[t]->Playout(level, compact, *root, enemyHealth);
+                count++;
+            }
+        };
+        if(root->edges.size() > 1)
+        {
+            std::vector<std::thread> workers;
+            for(int t = 1; t < int(walkers.size()); t++)
+                workers.emplace_back(work, t);
+            work(0);
+            for(auto &worker : workers)
+                worker.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        playouts += count;
+        seconds += elapsed.count();
+
+        // the most visited turn
+        const Edge* best = &root->edges.front();
+        for(const Edge& edge : root->edges)
+            if(edge.visits > best->visits)
+                best = &edge;
+        DicePlan plan = Reorder(best->plan, sorted, dice);
+        plan.value = best->visits ? best->reward / SCALE / best->visits : 0;
+        return plan;
+    }
+
+    int Threads() const
+    {
+        return int(walkers.size());
+    }
+    long long Playouts() const
+    {
+        return playouts;
+    }
+    double Seconds() const
+    {
+        return seconds;
+    }
+
+private:
+    static constexpr double EXPLORATION = 0.7;
+    static constexpr double WIDENING = 2;
+    static constexpr size_t CANDIDATES = 24;
+    // rewards are kept in millionths
+    static constexpr double SCALE = 1e6;
+
+    struct Chance;
+    struct Edge
+    {
+        // for the roll in ascending order
+        DicePlan plan;
+        std::atomic<int> visits{0};
+        std::atomic<long long> reward{0};
+        // created under Decision::guard
+        std::unique_ptr<Chance> next;
+    };
+    struct Decision
+    {
+        // ascending
+        std::vector<int> dice;
+        std::deque<Edge> edges;
+        std::atomic<int> visits{0};
+        std::mutex guard;
+    };
+    struct Chance
+    {
+        std::mutex guard;
+        // by the roll in ascending order
+        std::map<std::vector<int>, std::unique_ptr<Decision>> rolls;
+    };
+
+    // one thread's playouts, with its own context, solver and level copy;
+    // it plans the turns of the copy's hero
+    class Walker : public TurnPlanner
+    {
+    public:
+        Walker(MctsPlanner& owner, uint64_t seed)
+            :owner(owner), controller(*this)
+        {
+            context.rng.Seed(seed);
+            context.controller = &controller;
+            context.traced = false;
+        }
+
+        // starts from the snapshot of start when there is one, a copy otherwise
+        void Playout(const Level& start, const LevelSnapshot* snapshot, Decision& from, int enemyHealth)
+        {
+            if(level && snapshot)
+            {
+                level->Restore(*snapshot);
+            }
+            else
+            {
+                level.reset(new Level(start));
+                level->SetContext(context);
+                level->GetHero().SetController(controller);
+            }
+            path.clear();
+            root = &from;
+            next = nullptr;
+            level->HeroTurn(from.dice);
+
+            double reward = 0;
+            for(int turn = 1; ; turn++)
+            {
+                if(level->isClear())
+                {
+                    reward = 0.5 + 0.5 * Life();
+                    break;
+                }
+                if(level->EnemiesTurn())
+                    break;
+                if(turn >= owner.horizon)
+                {
+                    int left = 0;
+                    const Enemies& enemies = level->GetEnemies();
+                    for(int i = 0; i < enemies.size(); i++)
+                        left += enemies.GetStats(i).health;
+                    reward = 0.5 * Life() * (1 - 0.5 * left / std::max(enemyHealth, 1));
+                    break;
+                }
+                level->HeroTurn();
+            }
+            for(Edge* edge : path)
+                edge->reward += (long long)(reward * SCALE);
+        }
+
+        DicePlan Plan(const Hero& hero, const Field& field, const Enemies& enemies,
+                      const std::vector<int>& dice) override
+        {
+            std::vector<int> sorted(dice);
+            std::sort(sorted.begin(), sorted.end());
+            Decision* decision = root;
+            bool added = false;
+            root = nullptr;
+            if(next)
+            {
+                std::lock_guard<std::mutex> lock(next->guard);
+                std::unique_ptr<Decision>& slot = next->rolls[sorted];
+                if(!slot)
+                {
+                    slot.reset(owner.Expand(solver, hero, field, enemies, sorted));
+                    added = true;
+                }
+                decision = slot.get();
+            }
+            next = nullptr;
+            if(!decision || decision->edges.empty())
+                return solver.Solve(hero, field, enemies, dice);
+
+            Edge& edge = owner.Select(*decision);
+            path.push_back(&edge);
+            if(!added)
+            {
+                std::lock_guard<std::mutex> lock(decision->guard);
+                if(!edge.next)
+                    edge.next.reset(new Chance);
+                next = edge.next.get();
+            }
+            return Reorder(edge.plan, sorted, dice);
+        }
+
+        DiceSolver solver;
+
+    private:
+        double Life()
+        {
+            return std::min(std::max(level->GetHero().GetStats().health, 0), 6) / 6.0;
+        }
+
+        MctsPlanner& owner;
+        GameContext context;
+        PlanController controller;
+        std::unique_ptr<Level> level;
+        // where the next roll goes, both nullptr - out of the tree
+        Decision* root = nullptr;
+        Chance* next = nullptr;
+        std::vector<Edge*> path;
+    };
+
+    Decision* Expand(DiceSolver& solver, const Hero& hero, const Field& field,
+                     const Enemies& enemies, const std::vector<int>& sorted)
+    {
+        Decision* decision = new Decision;
+        decision->dice = sorted;
+        std::vector<DicePlan> plans;
+        solver.Candidates(hero, field, enemies, sorted, CANDIDATES, plans);
+        for(DicePlan& plan : plans)
+        {
+            decision->edges.emplace_back();
+            decision->edges.back().plan = std::move(plan);
+        }
+        return decision;
+    }
+    // UCT over the opened edges, unvisited ones first in solver order
+    Edge& Select(Decision& decision)
+    {
+        int visits = ++decision.visits;
+        size_t open = std::min(decision.edges.size(), size_t(1 + WIDENING * std::sqrt(double(visits))));
+        // parenthesized, log is a macro in headless builds
+        double logVisits = (std::log)(double(visits));
+        Edge* best = &decision.edges.front();
+        double bestScore = -1;
+        for(size_t i = 0; i < open; i++)
+        {
+            Edge& edge = decision.edges[i];
+            int n = edge.visits;
+            if(!n)
+            {
+                best = &edge;
+                break;
+            }
+            double score = edge.reward / SCALE / n + EXPLORATION * std::sqrt(logVisits / n);
+            if(score > bestScore)
+            {
+                bestScore = score;
+                best = &edge;
+            }
+        }
+        best->visits++;
+        return *best;
+    }
+    // the plan for the roll in ascending order, for the roll as it came
+    static DicePlan Reorder(const DicePlan& plan, const std::vector<int>& sorted,
+                            const std::vector<int>& dice)
+    {
+        DicePlan result = plan;
+        std::vector<char> used(sorted.size(), 0);
+        for(size_t i = 0; i < dice.size(); i++)
+            for(size_t j = 0; j < sorted.size(); j++)
+                if(!used[j] && sorted[j] == dice[i])
+                {
+                    used[j] = 1;
+                    result.assignment[i] = plan.assignment[j];
+                    break;
+                }
+        return result;
+    }
+
+    int budget;
+    int horizon;
+    Rng seeds;
+    std::vector<std::unique_ptr<Walker>> walkers;
+    long long playouts = 0;
+    double seconds = 0;
+};
+
+// Where the levels of a game come from, kept with a save so the game goes
+// on with the same levels: the campaign or the level pack at pack path;
+// index - the level's number there.
+enum class levelOrigin : uint8_t { campaign, pack };
+struct SaveOrigin
+{
+    levelOrigin source = levelOrigin::campaign;
+    std::string pack;
+    int index = 0;
+};
+
+// Ordered levels of one game. Get() hands out level number index for a
+// hero who has just cleared the previous one.
+class LevelSource
+{
+public:
+    virtual ~LevelSource() = default;
+    virtual int Count() const = 0;
+    // nullptr - the level can not be built
+    virtual Level* Get(int index, const Hero& hero) = 0;
+    // where level number index comes from
+    virtual SaveOrigin Origin(int index) const
+    {
+        return {levelOrigin::campaign, "", index};
+    }
+};
+
+// Levels built up front, each with its own copy of the hero.
+class CampaignLevels : public LevelSource
+{
+public:
+    CampaignLevels(std::vector<Level>& levels): levels(levels) {}
+
+    int Count() const override
+    {
+        return int(levels.size());
+    }
+    Level* Get(int index, const Hero&) override
+    {
+        return &levels.at(index);
+    }
+
+private:
+    std::vector<Level>& levels;
+};
+
+// The campaign for game after game of one hero: built once, Reset() puts
+// every level back from its snapshot without allocating.
+class CampaignGames : public LevelSource
+{
+public:
+    CampaignGames(const Hero& adventurer)
+    {
+        Hero hero(adventurer);
+        BuildCampaign(levels, hero);
+        snapshots.resize(levels.size());
+        for(size_t i = 0; i < levels.size(); i++)
+            levels[i].Save(snapshots[i]);
+    }
+    void Reset()
+    {
+        for(size_t i = 0; i < levels.size(); i++)
+            levels[i].Restore(snapshots[i]);
+    }
+    int Count() const override
+    {
+        return int(levels.size());
+    }
+    Level* Get(int index, const Hero&) override
+    {
+        return &levels.at(index);
+    }
+
+private:
+    std::vector<Level> levels;
+    std::vector<LevelSnapshot> snapshots;
+};
+
+// Read-only memory map of a whole file.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const std::string& path)
+    {
+        Close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        size = size_t(fileSize.QuadPart);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if(mapping)
+            data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat info;
+        if(fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            size = size_t(info.st_size);
+            void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(view != MAP_FAILED)
+                data = static_cast<const char*>(view);
+        }
+        close(fd);
+#endif
+        if(!data)
+            Close();
+        return data != nullptr;
+    }
+    void Close()
+    {
+#ifdef _WIN32
+        if(data)
+            UnmapViewOfFile(data);
+        if(mapping)
+            CloseHandle(mapping);
+        if(file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if(data)
+            munmap(const_cast<char*>(data), size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+    const char* Data() const
+    {
+        return data;
+    }
+    size_t Size() const
+    {
+        return size;
+    }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+// Level pack, version 1, little endian:
+//   PackHeader
+//   per level: PackLevel, wall plane words (uint64, bit x*cols+y),
+//              PackEnemy[enemyCount]
+//   index: uint64 file offset of every level
+// Every part is a multiple of 8 bytes, so the wall words stay aligned.
+const uint32_t PACK_VERSION = 1;
+struct PackHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t indexOffset;
+};
+struct PackLevel
+{
+    uint16_t rows, cols;
+    uint16_t startX, startY;
+    uint32_t id;
+    uint32_t enemyCount;
+};
+struct PackEnemy
+{
+    uint8_t kind;
+    uint8_t reserved;
+    uint16_t x, y;
+    uint16_t reserved2;
+};
+static_assert(sizeof(PackHeader) == 24 && sizeof(PackLevel) == 16
+              && sizeof(PackEnemy) == 8, "level pack layout");
+
+// Writes levels one by one, the index goes at the end on Finish().
+class LevelPackWriter
+{
+public:
+    LevelPackWriter(const std::string& path)
+        :file(path, std::ios::binary)
+    {
+        PackHeader header = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    ~LevelPackWriter()
+    {
+        Finish();
+    }
+
+    void Add(const LevelSpec& spec)
+    {
+        offsets.push_back(uint64_t(file.tellp()));
+        PackLevel level = {uint16_t(spec.rows), uint16_t(spec.cols),
+                           uint16_t(spec.start.x), uint16_t(spec.start.y),
+                           uint32_t(spec.id), uint32_t(spec.enemies.size())};
+        file.write(reinterpret_cast<const char*>(&level), sizeof(level));
+
+        walls.assign((spec.rows * spec.cols + 63) / 64, 0);
+        for(const coord& wall : spec.walls)
+        {
+            int i = wall.x * spec.cols + wall.y;
+            walls[i / 64] |= 1ull << (i % 64);
+        }
+        file.write(reinterpret_cast<const char*>(walls.data()), walls.size() * sizeof(uint64_t));
+
+        for(const auto& enemy : spec.enemies)
+        {
+            PackEnemy packed = {uint8_t(enemy.first), 0,
+                                uint16_t(enemy.second.x), uint16_t(enemy.second.y), 0};
+            file.write(reinterpret_cast<const char*>(&packed), sizeof(packed));
+        }
+    }
+    bool Finish()
+    {
+        if(!file.is_open())
+            return false;
+        PackHeader header = {{'O', 'C', 'D', 'P'}, PACK_VERSION,
+                             uint32_t(offsets.size()), 0, uint64_t(file.tellp())};
+        file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.close();
+        return !file.fail();
+    }
+
+private:
+    std::ofstream file;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> walls;
+};
+
+// Memory-mapped level pack. Opening checks the header and every level
+// record; a level is built when it is reached, straight from the mapped
+// bytes, for the hero who cleared the one before.
+class LevelPack : public LevelSource
+{
+public:
+    bool Open(const std::string& path)
+    {
+        header = nullptr;
+        this->path = path;
+        if(!file.Open(path) || file.Size() < sizeof(PackHeader))
+            return false;
+        const PackHeader* candidate = reinterpret_cast<const PackHeader*>(file.Data());
+        if(std::memcmp(candidate->magic, "OCDP", 4) != 0 || candidate->version != PACK_VERSION
+            || candidate->indexOffset > file.Size()
+            || candidate->count * sizeof(uint64_t) > file.Size() - candidate->indexOffset)
+            return false;
+        const uint64_t* offsets = reinterpret_cast<const uint64_t*>(file.Data() + candidate->indexOffset);
+        for(uint32_t i = 0; i < candidate->count; i++)
+            if(!Valid(offsets[i]))
+                return false;
+        header = candidate;
+        return true;
+    }
+    int Count() const override
+    {
+        return header ? int(header->count) : 0;
+    }
+    SaveOrigin Origin(int index) const override
+    {
+        return {levelOrigin::pack, path, index};
+    }
+    Level* Get(int index, const Hero& hero) override
+    {
+        const char* data = file.Data();
+        const uint64_t* offsets = reinterpret_cast<const uint64_t*>(data + header->indexOffset);
+        if(index < 0 || uint32_t(index) >= header->count)
+            return nullptr;
+        const char* record = data + offsets[index];
+        const PackLevel* packed = reinterpret_cast<const PackLevel*>(record);
+        record += sizeof(PackLevel);
+
+        current.reset(new Level(hero, int(packed->id), packed->rows, packed->cols,
+                                coord(packed->startX, packed->startY)));
+        current->SetWalls(record);
+        record += (packed->rows * packed->cols + 63) / 64 * sizeof(uint64_t);
+        const PackEnemy* enemies = reinterpret_cast<const PackEnemy*>(record);
+        for(uint32_t i = 0; i < packed->enemyCount; i++)
+            current->AddEnemy(monster(enemies[i].kind), coord(enemies[i].x, enemies[i].y));
+        return current.get();
+    }
+
+private:
+    // the record at offset fits the file, its map the field, its hero and
+    // enemies the map, one to a cell
+    bool Valid(uint64_t offset) const
+    {
+        uint64_t size = file.Size();
+        if(offset > size || size - offset < sizeof(PackLevel))
+            return false;
+        const PackLevel* packed = reinterpret_cast<const PackLevel*>(file.Data() + offset);
+        int rows = packed->rows, cols = packed->cols;
+        if(rows <= 0 || cols <= 0 || int64_t(rows) * cols > MAX_CELLS)
+            return false;
+        uint64_t words = (rows * cols + 63) / 64;
+        if(packed->enemyCount > uint64_t(rows) * cols
+            || size - offset - sizeof(PackLevel) < words * sizeof(uint64_t) + packed->enemyCount * sizeof(PackEnemy))
+            return false;
+        if(packed->startX >= rows || packed->startY >= cols)
+            return false;
+        std::vector<char> taken(rows * cols, 0);
+        taken[packed->startX * cols + packed->startY] = 1;
+        const PackEnemy* enemies = reinterpret_cast<const PackEnemy*>(
+            file.Data() + offset + sizeof(PackLevel) + words * sizeof(uint64_t));
+        for(uint32_t i = 0; i < packed->enemyCount; i++)
+        {
+            const PackEnemy& enemy = enemies[i];
+            if(enemy.kind > uint8_t(monster::dragon) || enemy.x >= rows || enemy.y >= cols
+                || taken[enemy.x * cols + enemy.y])
+                return false;
+            taken[enemy.x * cols + enemy.y] = 1;
+        }
+        return true;
+    }
+
+    MappedFile file;
+    std::string path;
+    const PackHeader* header = nullptr;
+    std::unique_ptr<Level> current;
+};
+
+// Save game: SaveHeader, the pack path of a pack game, then the
+// LevelSnapshot bytes as they are.
+const uint32_t SAVE_VERSION = 2;
+struct SaveHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t source;
+    uint32_t index;
+    uint32_t packSize;
+};
+
+std::string encodeSave(const SaveOrigin& origin, const LevelSnapshot& snapshot)
+{
+    SaveHeader header = {{'O', 'C', 'D', 'S'}, SAVE_VERSION, uint32_t(sizeof(snapshot)),
+                         uint32_t(origin.source), uint32_t(origin.index), uint32_t(origin.pack.size())};
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data += origin.pack;
+    data.append(reinterpret_cast<const char*>(&snapshot), sizeof(snapshot));
+    return data;
+}
+bool decodeSave(const std::string& data, SaveOrigin& origin, LevelSnapshot& snapshot)
+{
+    SaveHeader header;
+    if(data.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if(std::memcmp(header.magic, "OCDS", 4) != 0 || header.version != SAVE_VERSION
+        || header.size != sizeof(snapshot) || header.source > uint32_t(levelOrigin::pack)
+        || header.index >= (1u << 31)
+        || data.size() != sizeof(header) + header.packSize + sizeof(snapshot))
+        return false;
+    origin.source = levelOrigin(header.source);
+    origin.index = int(header.index);
+    origin.pack = data.substr(sizeof(header), header.packSize);
+    std::memcpy(&snapshot, data.data() + sizeof(header) + header.packSize, sizeof(snapshot));
+    return validSnapshot(snapshot);
+}
+bool saveGame(const std::string& path, const SaveOrigin& origin, const LevelSnapshot& snapshot)
+{
+    std::ofstream file(path, std::ios::binary);
+    std::string data = encodeSave(origin, snapshot);
+    file.write(data.data(), data.size());
+    return bool(file);
+}
+bool loadGame(const std::string& path, SaveOrigin& origin, LevelSnapshot& snapshot)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return decodeSave(data, origin, snapshot);
+}
+
+// A saved game: the saved level, then the levels after it where it came
+// from.
+class SavedGame : public LevelSource
+{
+public:
+    SavedGame(const LevelSnapshot& snapshot, const SaveOrigin& origin)
+        :snapshot(snapshot), origin(origin)
+    {
+    }
+    // false - the level pack of the game can not be opened
+    bool Open()
+    {
+        if(origin.source == levelOrigin::pack)
+            return pack.Open(origin.pack);
+        specs = campaignSpecs();
+        return true;
+    }
+
+    int Count() const override
+    {
+        int total = origin.source == levelOrigin::pack ? pack.Count() : int(specs.size());
+        return 1 + std::max(0, total - origin.index - 1);
+    }
+    Level* Get(int index, const Hero& hero) override
+    {
+        if(index == 0)
+        {
+            current.reset(new Level(hero, snapshot));
+            return current.get();
+        }
+        if(origin.source == levelOrigin::pack)
+            return pack.Get(origin.index + index, hero);
+        current.reset(new Level(hero, specs.at(origin.index + index)));
+        return current.get();
+    }
+    SaveOrigin Origin(int index) const override
+    {
+        return {origin.source, origin.pack, origin.index + index};
+    }
+
+private:
+    LevelSnapshot snapshot;
+    SaveOrigin origin;
+    LevelPack pack;
+    std::vector<LevelSpec> specs;
+    std::unique_ptr<Level> current;
+};
+
+// Replay: ReplayHeader, the level source (the pack path or the saved
+// game as its save file holds it), then one byte for every hero decision, the kind
+// in the top two bits:
+//   00 t.vv   die - v: 0 auto, 1 S, 2 A, 3 D; t: the first die of a turn
+//   01 vvvv   move - numpad key
+//   10 vvvvvv target - index, 62 - index 62 + the next byte, 63 - the first
+//   11 vvv    buff - 0 h, 1 m, 2 a, 3 d, 4 r
+// With the seed it is the whole game, a turn is a few bytes.
+const uint32_t REPLAY_VERSION = 2;
+enum class replaySource : uint8_t { campaign, pack, saved };
+struct ReplayHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t seed;
+    uint32_t source;
+    uint32_t sourceSize;
+};
+enum class decision : uint8_t { die, move, target, buff };
+
+// same cases as Hero::AssignDice, Hero::Move and Hero::Buff
+uint8_t dieCode(char choice)
+{
+    switch(choice)
+    {
+    case '1': case 'S': case 's': return 1;
+    case '2': case 'A': case 'a': return 2;
+    case '3': case 'D': case 'd': return 3;
+    default: return 0;
+    }
+}
+uint8_t moveCode(char key)
+{
+    switch(key)
+    {
+    case 'w': case 'W': return 8;
+    case 'a': case 'A': return 4;
+    case 's': case 'S': return 2;
+    case 'd': case 'D': return 6;
+    default: return (key >= '1' && key <= '9') ? key - '0' : 5;
+    }
+}
+uint8_t buffCode(char buff)
+{
+    switch(buff)
+    {
+    case 'm': return 1;
+    case 'a': return 2;
+    case 'd': return 3;
+    case 'r': return 4;
+    default: return 0;
+    }
+}
+
+// Passes the decisions of another controller through and writes them to
+// a replay file, flushed at the start of every hero turn.
+class RecordingController : public Controller
+{
+public:
+    RecordingController(const GameContext& context, const std::string& path, Controller& inner,
+                        uint64_t seed, replaySource source, const std::string& sourceData = "")
+        :inner(inner), file(path, std::ios::binary)
+    {
+        ReplayHeader header = {{'O', 'C', 'D', 'R'}, REPLAY_VERSION, seed,
+                               uint32_t(source), uint32_t(sourceData.size())};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(sourceData.data(), sourceData.size());
+        if(!file)
+            log(context, "Can not write replay " + path, colorCode::red);
+    }
+
+    char ChooseDie(const Hero& hero, const Field& field, const Enemies& enemies,
+                   const std::vector<int>& dice, int index) override
+    {
+        if(index == 0)
+            file.flush();
+        char choice = inner.ChooseDie(hero, field, enemies, dice, index);
+        Write(decision::die, dieCode(choice) | (index == 0 ? 4 : 0));
+        return choice;
+    }
+    char ChooseMove(const Hero& hero, const Field& field) override
+    {
+        char key = inner.ChooseMove(hero, field);
+        Write(decision::move, moveCode(key));
+        return key;
+    }
+    int ChooseTarget(const Hero& hero, const Enemies& enemies,
+                     const std::vector<EnemyHandle>& targets) override
+    {
+        int num = inner.ChooseTarget(hero, enemies, targets);
+        if(num < 0 || num >= int(targets.size()) || num - 62 > 255)
+            Write(decision::target, 63);
+        else if(num >= 62)
+        {
+            Write(decision::target, 62);
+            file.put(char(num - 62));
+        }
+        else
+            Write(decision::target, num);
+        return num;
+    }
+    char ChooseBuff(const Hero& hero) override
+    {
+        char buff = inner.ChooseBuff(hero);
+        Write(decision::buff, buffCode(buff));
+        return buff;
+    }
+
+private:
+    void Write(decision kind, int value)
+    {
+        file.put(char(int(kind) << 6 | value));
+    }
+    Controller& inner;
+    std::ofstream file;
+};
+
+// Plays the decisions of a replay file back. The game runs without
+// output up to turn showFrom and on the terminal from there on.
+class ReplayController : public Controller
+{
+public:
+    bool Open(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if(!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+            || std::memcmp(header.magic, "OCDR", 4) != 0 || header.version != REPLAY_VERSION
+            || header.source > uint32_t(replaySource::saved))
+        {
+            return false;
+        }
+        source.resize(header.sourceSize);
+        if(!file.read(&source[0], source.size()))
+            return false;
+        decisions.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        turns = 0;
+        for(size_t i = 0; i < decisions.size(); i++)
+        {
+            uint8_t byte = decisions[i];
+            if(byte >> 6 == int(decision::die) && (byte & 4))
+                turns++;
+            else if(byte >> 6 == int(decision::target) && (byte & 63) == 62)
+                i++;
+        }
+        return true;
+    }
+    uint64_t Seed() const
+    {
+        return header.seed;
+    }
+    replaySource Source() const
+    {
+        return replaySource(header.source);
+    }
+    // the pack path or the LevelSnapshot bytes
+    const std::string& SourceData() const
+    {
+        return source;
+    }
+    // hero turns recorded
+    int Turns() const
+    {
+        return turns;
+    }
+    // turn number (from 1) to start showing the game with this sink and renderer
+    void ShowFrom(int turn, LogSink* sink, Renderer* renderer)
+    {
+        showFrom = turn;
+        showSink = sink;
+        showRenderer = renderer;
+    }
+
+    char ChooseDie(const Hero& hero, const Field& field, const Enemies& enemies,
+                   const std::vector<int>& dice, int index) override
+    {
+        if(index == 0 && ++turn == showFrom)
+        {
+            GameContext& context = hero.Context();
+            context.sink = showSink;
+            context.renderer = showRenderer;
+            log(context, "TURN " + std::to_string(turn), colorCode::green);
+            field.Print(context);
+            for(int id = 0; id < enemies.size(); id++)
+            {
+                log(context, id, " ");
+                enemies.Print(id);
+            }
+            for(size_t i = 0; i < dice.size(); i++)
+                log(context, dice[i], " ");
+            log(context, "\t: RNG");
+        }
+        static const char dies[] = {0, 'S', 'A', 'D'};
+        int value = Next(decision::die);
+        return value < 0 ? 0 : dies[value & 3];
+    }
+    char ChooseMove(const Hero&, const Field&) override
+    {
+        int value = Next(decision::move);
+        return value < 0 ? '5' : char('0' + value);
+    }
+    int ChooseTarget(const Hero&, const Enemies&, const std::vector<EnemyHandle>&) override
+    {
+        int value = Next(decision::target);
+        if(value == 62 && position < decisions.size())
+            return 62 + uint8_t(decisions[position++]);
+        return value < 0 || value == 63 ? -1 : value;
+    }
+    char ChooseBuff(const Hero&) override
+    {
+        static const char buffs[] = {'h', 'm', 'a', 'd', 'r'};
+        int value = Next(decision::buff);
+        return value < 0 || value > 4 ? 'h' : buffs[value];
+    }
+
+private:
+    // the value of the next decision, -1 once the record is over
+    // or if it is not of this kind
+    int Next(decision kind)
+    {
+        if(position >= decisions.size() || uint8_t(decisions[position]) >> 6 != int(kind))
+            return -1;
+        return decisions[position++] & 63;
+    }
+
+    ReplayHeader header = {};
+    std::string source;
+    std::string decisions;
+    size_t position = 0;
+    int turns = 0;
+    int turn = 0;
+    int showFrom = 0;
+    LogSink* showSink = nullptr;
+    Renderer* showRenderer = nullptr;
+};
+
+struct GeneratorSettings
+{
+    int rows = DEFAULT_ROWS;
+    int cols = DEFAULT_COLS;
+    double wallDensity = 0.15;
+    int enemies = 2;
+    // relative odds of spider, skeletonArcher, minotaur, dragon
+    int mix[4] = {1, 1, 1, 1};
+
+    // the map fits a level pack and has a cell for the hero and every enemy
+    bool Valid() const
+    {
+        return rows >= 1 && cols >= 1 && rows <= 0xffff && cols <= 0xffff
+            && int64_t(rows) * cols <= MAX_CELLS && enemies >= 0 && enemies < rows * cols;
+    }
+};
+
+// Random levels that can be won: the hero start is free and every enemy
+// can be reached from it. Level number i always comes out the same for
+// the same seed, whatever thread builds it.
+class LevelGenerator
+{
+public:
+    LevelGenerator(const GeneratorSettings& settings, uint64_t seed)
+        :settings(settings), seed(seed), field(settings.rows, settings.cols)
+    {
+        int cells = settings.rows * settings.cols;
+        wallThreshold = uint32_t(std::min(1.0, std::max(0.0, settings.wallDensity)) * 4294967295.0);
+        for(int weight : settings.mix)
+            mixTotal += std::max(weight, 0);
+        free.reserve(cells);
+    }
+
+    // fills spec with level number id, returns the number of tries
+    int Generate(LevelSpec& spec, int id)
+    {
+        Rng random(seed ^ (uint64_t(id) * 0x9e3779b97f4a7c15ull));
+        spec.id = id;
+        spec.rows = settings.rows;
+        spec.cols = settings.cols;
+        spec.start = startCorner(id, settings.rows, settings.cols);
+        for(int tries = 1; ; tries++)
+        {
+            field.Clear();
+            spec.walls.clear();
+            spec.enemies.clear();
+            free.clear();
+            for(int i = 0; i < settings.rows; i++)
+                for(int j = 0; j < settings.cols; j++)
+                {
+                    if(coord(i, j) == spec.start)
+                        continue;
+                    if(uint32_t(random.Next()) < wallThreshold)
+                    {
+                        field.AddWall({i, j});
+                        spec.walls.push_back({i, j});
+                    }
+                    else
+                    {
+                        free.push_back({i, j});
+                    }
+                }
+            for(int e = 0; e < settings.enemies && !free.empty(); e++)
+            {
+                int pick = random.Below(int(free.size()));
+                coord pos = free[pick];
+                free[pick] = free.back();
+                free.pop_back();
+                field.SetCell(pos, cell::enemy);
+                spec.enemies.push_back({Kind(random), pos});
+            }
+            if(field.EnemiesReachable(spec.start))
+            {
+                spec.hash = field.Hash() ^ zobristCell(field.Index(spec.start), cell::hero);
+                for(const auto& enemy : spec.enemies)
+                    spec.hash ^= zobrist(uint64_t(6) << 56 | uint64_t(enemy.first) << 40
+                                         | uint64_t(field.Index(enemy.second)));
+                return tries;
+            }
+        }
+    }
+
+private:
+    monster Kind(Rng& random)
+    {
+        if(mixTotal <= 0)
+            return monster::spider;
+        int roll = random.Below(mixTotal);
+        for(int k = 0; k < 4; k++)
+        {
+            roll -= std::max(settings.mix[k], 0);
+            if(roll < 0)
+                return monster(k);
+        }
+        return monster::dragon;
+    }
+
+    GeneratorSettings settings;
+    uint64_t seed;
+    Field field;
+    uint32_t wallThreshold;
+    int mixTotal = 0;
+    std::vector<coord> free;
+};
+
+// Generates levels 1..count on threads threads (0 - all cores) and hands
+// them to sink(const LevelSpec&) in order, one batch at a time.
+template<class Sink>
+void generateLevels(const GeneratorSettings& settings, int count, uint64_t seed,
+                    int threads, Sink sink)
+{
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    const int batch = 4096;
+    std::vector<LevelSpec> specs(std::min(count, batch));
+    std::vector<LevelGenerator> generators(threads, LevelGenerator(settings, seed));
+    for(int first = 0; first < count; first += batch)
+    {
+        int size = std::min(batch, count - first);
+        auto work = [&](int t) {
+            for(int i = t; i < size; i += threads)
+                generators[t].Generate(specs[i], first + i + 1);
+        };
+        std::vector<std::thread> workers;
+        for(int t = 1; t < threads; t++)
+            workers.emplace_back(work, t);
+        work(0);
+        for(auto &worker : workers)
+            worker.join();
+        for(int i = 0; i < size; i++)
+            sink(specs[i]);
+    }
+}
+
+struct LevelResult
+{
+    int turns;
+    int health;
+};
+struct GameResult
+{
+    bool won = false;
+    int levelsCleared = 0;
+    int turns = 0;
+    // hero turns and health left for every cleared level
+    std::vector<LevelResult> cleared;
+};
+
+// Plays the levels in order until the hero dies, the last level is clear
+// or maxTurns hero turns have passed (0 - no limit). With a save path the
+// game is saved there at the start of every hero turn.
+GameResult PlayCampaign(LevelSource& levels, const Hero& adventurer, int maxTurns = 0,
+                        const std::string& savePath = "")
+{
+    GameResult result;
+    if(!levels.Count())
+        return result;
+    int index = 0;
+    int levelStart = 0;
+    GameContext& context = adventurer.Context();
+    TraceScope trace(context, "campaign");
+    Level* currLevel = levels.Get(index, adventurer);
+    if(!currLevel)
+        return result;
+    bool levelTraced = traceBegin(context, "level", index + 1);
+    while(currLevel->GetHero().GetStats().health > 0)
+    {
+        if(maxTurns && result.turns >= maxTurns)
+            break;
+        if(!savePath.empty())
+        {
+            LevelSnapshot snapshot;
+            if(currLevel->Save(snapshot))
+                saveGame(savePath, levels.Origin(index), snapshot);
+        }
+        PROFILE_POLL();
+        result.turns++;
+        bool cleared, lost = false;
+        {
+            TraceScope trace(context, "turn", result.turns);
+            currLevel->Print();
+            currLevel->PrintEnemies();
+            currLevel->HeroTurn();
+            cleared = currLevel->isClear();
+            if(!cleared)
+                lost = currLevel->EnemiesTurn();
+        }
+        if(cleared)
+        {
+            result.levelsCleared++;
+            result.cleared.push_back({result.turns - levelStart,
+                                      currLevel->GetHero().GetStats().health});
+            levelStart = result.turns;
+            if(index + 1 < levels.Count())
+            {
+                log(context, "Upgrade hero?", colorCode::green);
+                log(context, "Select h(raise health to 6) or m/a/d/r (to buff stat)");
+                Hero& hero = currLevel->GetHero();
+                hero.Buff(hero.GetController().ChooseBuff(hero));
+                currLevel = levels.Get(++index, hero);
+                if(levelTraced)
+                    traceEnd("level");
+                levelTraced = false;
+                if(!currLevel)
+                    break;
+                levelTraced = traceBegin(context, "level", index + 1);
+                continue;
+            }
+            else
+            {
+                log(context, "...", colorCode::green);
+                log(context, "...", colorCode::green);
+                log(context, "... THE END", colorCode::green);
+                result.won = true;
+                break;
+            }
+        }
+        if(lost)
+        {
+            log(context, ".. You lost! ..", colorCode::red);
+            currLevel->GetHero().Print();
+            continue;
+        }
+        clearScrean(context);
+    }
+    if(levelTraced)
+        traceEnd("level");
+    return result;
+}
+
+// Fixed set of worker threads, each with its own task deque. A worker
+// takes its own tasks from the back and, once it runs dry, steals from
+// the front of the others. The deques are short critical sections;
+// tasks are meant to be coarse (a batch of games).
+class WorkStealingPool
+{
+public:
+    WorkStealingPool(int threads)
+    {
+        if(threads <= 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        queues.reserve(threads);
+        for(int t = 0; t < threads; t++)
+            queues.emplace_back(new Queue);
+        for(int t = 0; t < threads; t++)
+            workers.emplace_back(&WorkStealingPool::Run, this, t);
+    }
+    ~WorkStealingPool()
+    {
+        Wait();
+        stop = true;
+        {
+            std::lock_guard<std::mutex> lock(sleep);
+        }
+        wake.notify_all();
+        for(auto &worker : workers)
+            worker.join();
+    }
+
+    int Threads() const
+    {
+        return int(workers.size());
+    }
+    // number of the worker running the calling task
+    static int Worker()
+    {
+        return workerIndex;
+    }
+    void Submit(std::function<void()> task)
+    {
+        Queue& queue = *queues[next++ % queues.size()];
+        {
+            // queued under the sleep lock, so a worker going to sleep
+            // either sees the task or gets the notification
+            std::lock_guard<std::mutex> lock(sleep);
+            {
+                std::lock_guard<std::mutex> lock(queue.guard);
+                queue.tasks.push_back(std::move(task));
+            }
+            unfinished++;
+            queued++;
+        }
+        wake.notify_one();
+    }
+    // blocks until every submitted task has run
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(sleep);
+        done.wait(lock, [this] { return unfinished == 0; });
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex guard;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool Take(int self, std::function<void()>& task)
+    {
+        {
+            Queue& own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.guard);
+            if(!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for(size_t k = 1; k < queues.size(); k++)
+        {
+            Queue& victim = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.guard);
+            if(!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    void Run(int self)
+    {
+        workerIndex = self;
+        std::function<void()> task;
+        while(true)
+        {
+            if(Take(self, task))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(sleep);
+                    queued--;
+                }
+                task();
+                task = nullptr;
+                std::lock_guard<std::mutex> lock(sleep);
+                if(--unfinished == 0)
+                    done.notify_all();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep);
+            wake.wait(lock, [this] { return stop || queued > 0; });
+            if(stop)
+                return;
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next{0};
+    std::atomic<bool> stop{false};
+    std::mutex sleep;
+    std::condition_variable wake, done;
+    int unfinished = 0;
+    // in the deques, not taken yet
+    int queued = 0;
+    static thread_local int workerIndex;
+};
+thread_local int WorkStealingPool::workerIndex = 0;
+
+// Totals of many games, updated without locks from any thread.
+class SimulationReport
+{
+public:
+    static const int HEALTH_BINS = 16;
+
+    SimulationReport(int levelCount)
+        :levels(levelCount)
+    {
+    }
+    void Record(const GameResult& result)
+    {
+        games++;
+        won += result.won;
+        turns += result.turns;
+        for(int i = 0; i < int(result.cleared.size()) && i < int(levels.size()); i++)
+        {
+            PerLevel& level = levels[i];
+            level.cleared++;
+            level.turns += result.cleared[i].turns;
+            int health = std::min(std::max(result.cleared[i].health, 0), HEALTH_BINS - 1);
+            level.health[health]++;
+        }
+        if(!result.won && result.levelsCleared < int(levels.size()))
+            levels[result.levelsCleared].lost++;
+    }
+    void Print(std::ostream& out) const
+    {
+        long long reached = games;
+        out << "games: " << games << "\twon: " << won
+            << "\tturns: " << turns << "\n";
+        out << "level\treached\twin%\tdied%\tturns\thealth left (0.." << HEALTH_BINS - 1 << ")\n";
+        for(size_t i = 0; i < levels.size(); i++)
+        {
+            const PerLevel& level = levels[i];
+            long long cleared = level.cleared;
+            out << i + 1 << '\t' << reached << '\t'
+                << (reached ? 100.0 * cleared / reached : 0) << '\t'
+                << (reached ? 100.0 * level.lost / reached : 0) << '\t'
+                << (cleared ? double(level.turns) / cleared : 0) << '\t';
+            for(int h = 0; h < HEALTH_BINS; h++)
+                out << level.health[h] << (h + 1 < HEALTH_BINS ? ' ' : '\n');
+            reached = cleared;
+        }
+    }
+
+private:
+    struct PerLevel
+    {
+        std::atomic<long long> cleared{0};
+        std::atomic<long long> lost{0};
+        std::atomic<long long> turns{0};
+        std::atomic<long long> health[HEALTH_BINS] = {};
+    };
+
+    std::atomic<long long> games{0}, won{0}, turns{0};
+    std::vector<PerLevel> levels;
+};
+
+// seed of game number game, the same for every thread count
+uint64_t gameSeed(uint64_t masterSeed, uint64_t game)
+{
+    uint64_t z = masterSeed + (game + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Plays games independent games of the campaign (or the pack) on a work
+// stealing pool. Every game seeds its worker's generator from the
+// master seed and its number, so the report is reproducible.
+// solverDepth > 0 plays with the dice solver instead of the auto policy.
+void RunSimulation(int games, uint64_t masterSeed, int threads,
+                   const std::string& packPath = "", int maxTurns = 1000, int solverDepth = 0)
+{
+    WorkStealingPool pool(threads);
+    std::vector<LevelPack> packs(pool.Threads());
+    std::vector<PolicyController> policies(pool.Threads());
+    std::vector<std::unique_ptr<DiceSolver>> solvers(pool.Threads());
+    std::vector<std::unique_ptr<PlanController>> planned(pool.Threads());
+    std::vector<GameContext> contexts(pool.Threads());
+    std::vector<std::unique_ptr<CampaignGames>> campaigns(pool.Threads());
+    for(int w = 0; w < pool.Threads(); w++)
+    {
+        contexts[w].controller = &policies[w];
+        if(solverDepth > 0)
+        {
+            solvers[w].reset(new DiceSolver(solverDepth));
+            planned[w].reset(new PlanController(*solvers[w]));
+            contexts[w].controller = planned[w].get();
+        }
+    }
+    int levelCount = int(campaignSpecs().size());
+    if(!packPath.empty())
+    {
+        for(auto &pack : packs)
+            if(!pack.Open(packPath))
+            {
+                std::cout << "Can not open level pack " << packPath << "\n";
+                return;
+            }
+        levelCount = packs.front().Count();
+    }
+    SimulationReport report(levelCount);
+
+    const int batch = 64;
+    auto start = std::chrono::steady_clock::now();
+    for(int first = 0; first < games; first += batch)
+    {
+        int last = std::min(games, first + batch);
+        pool.Submit([&, first, last] {
+            int worker = WorkStealingPool::Worker();
+            for(int game = first; game < last; game++)
+            {
+                contexts[worker].rng.Seed(gameSeed(masterSeed, game));
+                Hero adventurer(contexts[worker], "Viktor");
+                if(!packPath.empty())
+                {
+                    report.Record(PlayCampaign(packs[worker], adventurer, maxTurns));
+                }
+                else
+                {
+                    if(!campaigns[worker])
+                        campaigns[worker].reset(new CampaignGames(adventurer));
+                    campaigns[worker]->Reset();
+                    report.Record(PlayCampaign(*campaigns[worker], adventurer, maxTurns));
+                }
+            }
+        });
+    }
+    pool.Wait();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "seed: " << masterSeed << "\tthreads: " << pool.Threads()
+              << "\ttime: " << elapsed.count() << " s"
+              << "\tgames/s: " << (elapsed.count() > 0 ? games / elapsed.count() : 0) << "\n";
+    report.Print(std::cout);
+}
+
+// Plays the campaign games times without output and reports the throughput.
+// With a pack path the games play the pack instead.
+// A planner, when given, plays instead of the auto policy.
+void RunHeadless(int games, uint64_t seed, const std::string& packPath = "", int maxTurns = 1000,
+                 TurnPlanner* planner = nullptr)
+{
+    PolicyController policy;
+    std::unique_ptr<PlanController> planned;
+    GameContext context;
+    context.rng.Seed(seed);
+    context.controller = &policy;
+    if(planner)
+    {
+        planned.reset(new PlanController(*planner));
+        context.controller = planned.get();
+    }
+    LevelPack pack;
+    if(!packPath.empty() && !pack.Open(packPath))
+    {
+        std::cout << "Can not open level pack " << packPath << "\n";
+        return;
+    }
+    int won = 0;
+    long long turns = 0;
+    auto start = std::chrono::steady_clock::now();
+    Hero adventurer(context, "Viktor");
+    CampaignGames campaign(adventurer);
+    for(int game = 0; game < games; game++)
+    {
+        GameResult result;
+        if(!packPath.empty())
+        {
+            result = PlayCampaign(pack, adventurer, maxTurns);
+        }
+        else
+        {
+            campaign.Reset();
+            result = PlayCampaign(campaign, adventurer, maxTurns);
+        }
+        won += result.won;
+        turns += result.turns;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "seed: " << context.rng.GetSeed()
+              << "\tgames: " << games
+              << "\twon: " << won
+              << "\tturns: " << turns
+              << "\ttime: " << elapsed.count() << " s"
+              << "\tturns/s: " << (elapsed.count() > 0 ? turns / elapsed.count() : 0)
+              << "\n";
+}
+
+// Plays a replay file back with the recorded seed and decisions, without
+// output or from turn showFrom (0 - never) on the terminal.
+bool RunReplay(const std::string& path, int showFrom)
+{
+    ReplayController replay;
+    if(!replay.Open(path))
+    {
+        std::cout << "Not a replay: " << path << "\n";
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    GameContext context;
+    context.rng.Seed(replay.Seed());
+    context.controller = &replay;
+    if(showFrom > 0)
+        replay.ShowFrom(showFrom, defaultContext().sink, defaultContext().renderer);
+    Hero adventurer(context, "Viktor");
+    GameResult result;
+    if(replay.Source() == replaySource::saved)
+    {
+        LevelSnapshot snapshot;
+        SaveOrigin origin;
+        if(!decodeSave(replay.SourceData(), origin, snapshot))
+        {
+            std::cout << "Broken saved game in replay: " << path << "\n";
+            return false;
+        }
+        SavedGame saved(snapshot, origin);
+        if(!saved.Open())
+        {
+            std::cout << "Can not open level pack " << origin.pack << "\n";
+            return false;
+        }
+        result = PlayCampaign(saved, adventurer, replay.Turns());
+    }
+    else if(replay.Source() == replaySource::pack)
+    {
+        LevelPack pack;
+        if(!pack.Open(replay.SourceData()))
+        {
+            std::cout << "Can not open level pack " << replay.SourceData() << "\n";
+            return false;
+        }
+        result = PlayCampaign(pack, adventurer, replay.Turns());
+    }
+    else
+    {
+        std::vector<Level> levels;
+        BuildCampaign(levels, adventurer);
+        CampaignLevels campaign(levels);
+        result = PlayCampaign(campaign, adventurer, replay.Turns());
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if(context.sink)
+        context.sink->Sync();
+    std::cout << "seed: " << replay.Seed()
+              << "\tturns: " << result.turns
+              << "\tlevels: " << result.levelsCleared
+              << "\twon: " << result.won
+              << "\ttime: " << elapsed.count() << " s"
+              << "\n";
+    return true;
+}
+
+// Training environment: the campaign one hero decision per step, Gym
+// style. An action is an index into the choices of the current phase:
+//   dice       0..5 - S/A/D in the orders SAD SDA ASD ADS DSA DAS, 6 - auto
+//   first/last move  0..8 - numpad keys 1..9, 4 (key 5) ends the move
+//   target     index among the monsters in range (asked with two or more)
+//   buff       0..4 - h m a d r
+// Out of range actions do what the game does with bad input: auto dice,
+// end of the move, the first target, the health buff. The reward is +1
+// for a kill, +10 for a cleared level and -10 for dying.
+// Built with ONECARD_NO_MAIN (and best ONECARD_HEADLESS) the file is a
+// library, the onecard_* functions are its C interface.
+enum class envPhase : int8_t { dice, firstMove, target, lastMove, buff, over };
+
+// One environment's observation, written in place into the caller's
+// buffer. Maps are padded (or cut) to 8x8: walls, hero and monster cells,
+// then the health, attack, defence and range of the monster on a cell.
+struct EnvObservation
+{
+    static const int SIZE = 8;
+    static const int PLANES = 7;
+    int8_t planes[PLANES][SIZE][SIZE];
+    int8_t hero[5];
+    int8_t heroBase[5];
+    int8_t dice[3];
+    // envPhase of the next action and the number of its choices
+    int8_t phase;
+    int8_t actions;
+    int8_t level;
+};
+static_assert(std::is_trivially_copyable<EnvObservation>::value, "EnvObservation is written in place");
+
+// the campaign levels with their heroes (see BuildCampaign) as
+// snapshots, a new level is a Restore
+const std::vector<LevelSnapshot>& campaignSnapshots()
+{
+    static const std::vector<LevelSnapshot> snapshots = [] {
+        GameContext quiet;
+        Hero hero(quiet);
+        std::vector<Level> levels;
+        BuildCampaign(levels, hero);
+        std::vector<LevelSnapshot> saved(levels.size());
+        for(size_t i = 0; i < levels.size(); i++)
+            levels[i].Save(saved[i]);
+        return saved;
+    }();
+    return snapshots;
+}
+
+class DungeonEnv
+{
+public:
+    static const int MAX_TURNS = 1000;
+
+    DungeonEnv()
+        :controller(*this)
+    {
+        context.controller = &controller;
+        Hero hero(context);
+        level.reset(new Level(hero, campaignSnapshots().front()));
+    }
+    DungeonEnv(const DungeonEnv&) = delete;
+    DungeonEnv& operator=(const DungeonEnv&) = delete;
+
+    void Reset(uint64_t seed, EnvObservation& obs)
+    {
+        context.rng.Seed(seed);
+        index = 0;
+        turns = 0;
+        level->Restore(campaignSnapshots().front());
+        Roll();
+        Observe(obs);
+    }
+    // the reward of the action; done - the hero died, won or is out of turns
+    float Step(int action, EnvObservation& obs, bool& done)
+    {
+        float reward = 0;
+        switch(phase)
+        {
+        case envPhase::dice:
+            assignment = unsigned(action) < 6 ? orders[action] : "";
+            level->AssignDice(dice);
+            phase = envPhase::firstMove;
+            break;
+        case envPhase::firstMove:
+            if(unsigned(action) >= 9 || !level->HeroStep(char('1' + action)))
+                phase = envPhase::target;
+            break;
+        case envPhase::target:
+            target = action;
+            reward += Attack();
+            phase = envPhase::lastMove;
+            break;
+        case envPhase::lastMove:
+            if(unsigned(action) >= 9 || !level->HeroStep(char('1' + action)))
+                reward += EndTurn();
+            break;
+        case envPhase::buff:
+        {
+            // as in PlayCampaign the buff goes to the hero of the level
+            // just cleared, the next level brings its own
+            static const char buffs[] = {'h', 'm', 'a', 'd', 'r'};
+            level->GetHero().Buff(unsigned(action) < 5 ? buffs[action] : 'h');
+            level->Restore(campaignSnapshots()[++index]);
+            Roll();
+            break;
         }
-        return false;
+        case envPhase::over:
+            break;
+        }
+        reward += Advance();
+        done = phase == envPhase::over;
+        Observe(obs);
+        return reward;
+    }
+    const Level& GetLevel() const
+    {
+        return *level;
     }
 
-    const Field& GetField() {return field;}
-    Hero& GetHero() {return hero;}
-    colorCode GetColor() {return color;}
+private:
+    // hands the pending choices to Hero, which asks for them
+    class EnvController : public Controller
+    {
+    public:
+        EnvController(DungeonEnv& env): env(env) {}
+
+        char ChooseDie(const Hero&, const Field&, const Enemies&, const std::vector<int>&, int index) override
+        {
+            return index < int(env.assignment.size()) ? env.assignment[index] : 0;
+        }
+        char ChooseMove(const Hero&, const Field&) override
+        {
+            return '5';
+        }
+        int ChooseTarget(const Hero&, const Enemies&, const std::vector<EnemyHandle>&) override
+        {
+            return env.target;
+        }
+        char ChooseBuff(const Hero&) override
+        {
+            return 'h';
+        }
+
+    private:
+        DungeonEnv& env;
+    };
+
+    // plays on until the next decision: skips a move without movement
+    // and the target choice with at most one monster in range
+    float Advance()
+    {
+        float reward = 0;
+        int move = level->GetHero().GetStats().move;
+        if(phase == envPhase::firstMove && move <= 1)
+            phase = envPhase::target;
+        if(phase == envPhase::target)
+        {
+            if(level->HeroTargets() > 1)
+                return reward;
+            target = 0;
+            reward += Attack();
+            phase = envPhase::lastMove;
+            move = level->GetHero().GetStats().move;
+        }
+        if(phase == envPhase::lastMove && move <= 1)
+            reward += EndTurn();
+        return reward;
+    }
+    // the enemies turn and the start of the next decision
+    float EndTurn()
+    {
+        turns++;
+        if(level->isClear())
+        {
+            phase = index + 1 < int(campaignSnapshots().size()) ? envPhase::buff : envPhase::over;
+            return 10;
+        }
+        if(level->EnemiesTurn())
+        {
+            phase = envPhase::over;
+            return -10;
+        }
+        if(turns >= MAX_TURNS)
+        {
+            phase = envPhase::over;
+            return 0;
+        }
+        Roll();
+        return 0;
+    }
+    float Attack()
+    {
+        int before = level->GetEnemies().size();
+        level->HeroAttack();
+        return float(before - level->GetEnemies().size());
+    }
+    void Roll()
+    {
+        context.rng.RollDice(dice.data(), 3);
+        phase = envPhase::dice;
+    }
+    void Observe(EnvObservation& obs) const
+    {
+        std::memset(&obs, 0, sizeof(obs));
+        const Field& field = level->GetField();
+        const int size = EnvObservation::SIZE;
+        for(cell type : {cell::wall, cell::hero, cell::enemy})
+            field.ForEachCell(type, [&](coord pos) {
+                if(pos.x < size && pos.y < size)
+                    obs.planes[int(type) - 1][pos.x][pos.y] = 1;
+            });
+        const Enemies& enemies = level->GetEnemies();
+        for(int i = 0; i < enemies.size(); i++)
+        {
+            coord pos = enemies.GetPos(i);
+            if(pos.x >= size || pos.y >= size)
+                continue;
+            int8_t stats[5];
+            packStats(enemies.GetStats(i), stats);
+            obs.planes[3][pos.x][pos.y] = stats[0];
+            obs.planes[4][pos.x][pos.y] = stats[2];
+            obs.planes[5][pos.x][pos.y] = stats[3];
+            obs.planes[6][pos.x][pos.y] = stats[4];
+        }
+        const Hero& hero = level->GetHero();
+        packStats(hero.GetStats(), obs.hero);
+        packStats(hero.GetBaseStats(), obs.heroBase);
+        for(int d = 0; d < 3; d++)
+            obs.dice[d] = int8_t(dice[d]);
+        obs.phase = int8_t(phase);
+        obs.level = int8_t(level->GetId());
+        switch(phase)
+        {
+        case envPhase::dice: obs.actions = 7; break;
+        case envPhase::firstMove:
+        case envPhase::lastMove: obs.actions = 9; break;
+        case envPhase::target: obs.actions = int8_t(std::min(level->HeroTargets(), 127)); break;
+        case envPhase::buff: obs.actions = 5; break;
+        case envPhase::over: obs.actions = 0; break;
+        }
+    }
+
+    static constexpr const char* orders[6] = {"SAD", "SDA", "ASD", "ADS", "DSA", "DAS"};
+
+    EnvController controller;
+    GameContext context;
+    std::unique_ptr<Level> level;
+    std::vector<int> dice = std::vector<int>(3);
+    envPhase phase = envPhase::over;
+    std::string assignment;
+    int target = 0;
+    int index = 0;
+    int turns = 0;
+};
+
+// N environments stepped together, in slices across the pool's threads.
+// A finished environment starts its next episode at once, the
+// observation it returns is the new episode's first one. Episode k of
+// environment i plays seed gameSeed(seed, k * Size() + i), so a batch
+// replays the same whatever the thread count.
+class EnvBatch
+{
+public:
+    EnvBatch(int count, int threads = 1)
+        :episodes(count, 0)
+    {
+        for(int i = 0; i < count; i++)
+            envs.emplace_back(new DungeonEnv);
+        if(threads != 1)
+            pool.reset(new WorkStealingPool(threads));
+    }
+    int Size() const
+    {
+        return int(envs.size());
+    }
+    DungeonEnv& Get(int i)
+    {
+        return *envs[i];
+    }
+    void Reset(uint64_t seed, EnvObservation* obs)
+    {
+        this->seed = seed;
+        ForSlices([&](int first, int last) {
+            for(int i = first; i < last; i++)
+            {
+                episodes[i] = 0;
+                envs[i]->Reset(gameSeed(seed, i), obs[i]);
+            }
+        });
+    }
+    void Step(const int* actions, EnvObservation* obs, float* rewards, uint8_t* dones)
+    {
+        ForSlices([&](int first, int last) {
+            for(int i = first; i < last; i++)
+            {
+                bool done = false;
+                rewards[i] = envs[i]->Step(actions[i], obs[i], done);
+                dones[i] = done;
+                if(done)
+                    envs[i]->Reset(gameSeed(seed, uint64_t(++episodes[i]) * Size() + i), obs[i]);
+            }
+        });
+    }
 
 private:
-    int id;
-    colorCode color;
-    Field field;
-    Hero hero;
-    std::vector<Monster> enemies;
+    template<class F>
+    void ForSlices(F f)
+    {
+        int count = Size();
+        if(!pool || count < 2)
+        {
+            f(0, count);
+            return;
+        }
+        int slices = std::min(count, pool->Threads() * 4);
+        for(int s = 0; s < slices; s++)
+        {
+            int first = int(int64_t(count) * s / slices);
+            int last = int(int64_t(count) * (s + 1) / slices);
+            pool->Submit([&f, first, last] { f(first, last); });
+        }
+        pool->Wait();
+    }
 
+    std::vector<std::unique_ptr<DungeonEnv>> envs;
+    std::vector<uint64_t> episodes;
+    std::unique_ptr<WorkStealingPool> pool;
+    uint64_t seed = 0;
 };
 
-int main() {
-    enableAnsiColors();
-    OS();
+extern "C" {
+// count environments stepped on threads threads (0 - all cores)
+void* onecard_env_create(int count, int threads)
+{
+    return new EnvBatch(count, threads);
+}
+void onecard_env_destroy(void* batch)
+{
+    delete static_cast<EnvBatch*>(batch);
+}
+// bytes of one observation, the buffers hold count of them back to back
+int onecard_env_observation_size()
+{
+    return int(sizeof(EnvObservation));
+}
+void onecard_env_reset(void* batch, uint64_t seed, void* observations)
+{
+    static_cast<EnvBatch*>(batch)->Reset(seed, static_cast<EnvObservation*>(observations));
+}
+// steps environment index alone, no automatic reset
+float onecard_env_step(void* batch, int index, int action, void* observation, uint8_t* done)
+{
+    bool over = false;
+    float reward = static_cast<EnvBatch*>(batch)->Get(index).Step(
+        action, *static_cast<EnvObservation*>(observation), over);
+    *done = over;
+    return reward;
+}
+void onecard_env_step_many(void* batch, const int* actions, void* observations,
+                           float* rewards, uint8_t* dones)
+{
+    static_cast<EnvBatch*>(batch)->Step(actions, static_cast<EnvObservation*>(observations),
+                                        rewards, dones);
+}
+}
 
-    Hero adventurer("Viktor");
-    std::vector<Level> levels;
+// Benchmarks of the engine hot paths. A case runs its body in batches:
+// the batch size doubles until one batch takes a tenth of the case time,
+// then the case time is spent in batches of that size and the best and
+// median ns per operation are reported. Bodies fold what they compute
+// into benchSink, so nothing is optimized away.
+volatile uint64_t benchSink = 0;
 
-   levels.push_back(Level(adventurer, 1));
-   levels.back().AddWall({1, 3});
-   levels.back().AddWall({3, 3});
-   levels.back().AddWall({3, 1});
-   levels.back().AddEnemy(monster::spider, {0, 3});
-   levels.back().AddEnemy(monster::spider, {2, 4});
-    adventurer.SetStat('h', 5);
-    adventurer.Buff('a');
-
-    levels.push_back(Level(adventurer, 2));
-    levels.back().AddWall({2, 3});
-    levels.back().AddWall({3, 3});
-    levels.back().AddWall({3, 0});
-    levels.back().AddEnemy(monster::skeletonArcher, {1, 0});
-    levels.back().AddEnemy(monster::skeletonArcher, {0, 2});
-
-    levels.push_back(Level(adventurer, 3));
-    levels.back().AddWall({3, 1});
-    levels.back().AddWall({1, 1});
-    levels.back().AddWall({1, 3});
-    levels.back().AddEnemy(monster::minotaur, {1, 4});
-
-    levels.push_back(Level(adventurer, 4));
-    levels.back().AddWall({1, 1});
-    levels.back().AddWall({2, 1});
-    levels.back().AddWall({2, 4});
-    levels.back().AddEnemy(monster::dragon, {0, 1});
-
-    log();
-    auto currLevel = levels.begin();
-    while(currLevel->GetHero().GetStats().health > 0)
+struct BenchResult
+{
+    std::string name;
+    long long ops = 0;
+    double seconds = 0;
+    // best and median batch
+    double nsPerOp = 0;
+    double medianNsPerOp = 0;
+};
+
+class BenchSuite
+{
+public:
+    // body(n) runs n iterations and returns the operations done
+    using Body = std::function<long long(long long)>;
+
+    BenchSuite(double caseSeconds = 0.2): caseSeconds(caseSeconds) {}
+
+    void Add(const std::string& name, Body body)
+    {
+        cases.push_back({name, std::move(body)});
+    }
+    // runs the cases whose name contains filter
+    std::vector<BenchResult> Run(const std::string& filter, std::ostream& out)
     {
-        currLevel->Print();
-        currLevel->PrintEnemies();
-        currLevel->HeroTurn();
-        if(currLevel->isClear())
+        std::vector<BenchResult> results;
+        out << "benchmark\tns/op\tmedian\tops/s\n";
+        for(const Case& c : cases)
         {
-            if(currLevel != levels.end())
-            {
-                log("Upgrade hero?", colorCode::green);
-                log("Select h(raise health to 6) or m/a/d/r (to buff stat)");
-                char buff;
-                std::cin >> buff;
-                currLevel->GetHero().Buff(buff);
-                currLevel = std::next(currLevel);
+            if(c.name.find(filter) == std::string::npos)
                 continue;
+            BenchResult result = Measure(c);
+            out << result.name << '\t' << result.nsPerOp << '\t' << result.medianNsPerOp
+                << '\t' << (result.nsPerOp > 0 ? 1e9 / result.nsPerOp : 0) << "\n";
+            results.push_back(result);
+        }
+        return results;
+    }
+
+private:
+    struct Case
+    {
+        std::string name;
+        Body body;
+    };
+
+    BenchResult Measure(const Case& c) const
+    {
+        using clock = std::chrono::steady_clock;
+        long long batch = 1;
+        while(true)
+        {
+            auto start = clock::now();
+            c.body(batch);
+            std::chrono::duration<double> elapsed = clock::now() - start;
+            if(elapsed.count() >= caseSeconds / 10 || batch >= (1ll << 40))
+                break;
+            batch *= 2;
+        }
+        BenchResult result;
+        result.name = c.name;
+        std::vector<double> perOp;
+        auto end = clock::now() + std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(caseSeconds));
+        do
+        {
+            auto start = clock::now();
+            long long ops = c.body(batch);
+            std::chrono::duration<double> elapsed = clock::now() - start;
+            result.ops += ops;
+            result.seconds += elapsed.count();
+            perOp.push_back(elapsed.count() * 1e9 / std::max(ops, 1ll));
+        } while(clock::now() < end || perOp.size() < 3);
+        std::sort(perOp.begin(), perOp.end());
+        result.nsPerOp = perOp.front();
+        result.medianNsPerOp = perOp[perOp.size() / 2];
+        return result;
+    }
+
+    double caseSeconds;
+    std::vector<Case> cases;
+};
+
+bool writeBenchJson(const std::string& path, const std::vector<BenchResult>& results)
+{
+    std::ofstream file(path);
+    file << "{\"benchmarks\": [\n";
+    for(size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& r = results[i];
+        file << "  {\"name\": \"" << r.name << "\", \"ops\": " << r.ops
+             << ", \"seconds\": " << r.seconds << ", \"ns_per_op\": " << r.nsPerOp
+             << ", \"median_ns_per_op\": " << r.medianNsPerOp << "}"
+             << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    file << "]}\n";
+    return bool(file);
+}
+bool writeBenchCsv(const std::string& path, const std::vector<BenchResult>& results)
+{
+    std::ofstream file(path);
+    file << "name,ops,seconds,ns_per_op,median_ns_per_op\n";
+    for(const BenchResult& r : results)
+        file << r.name << ',' << r.ops << ',' << r.seconds << ','
+             << r.nsPerOp << ',' << r.medianNsPerOp << "\n";
+    return bool(file);
+}
+// best ns per op by name from a file written by writeBenchJson or
+// writeBenchCsv
+std::map<std::string, double> readBenchBaseline(const std::string& path)
+{
+    std::map<std::string, double> baseline;
+    std::ifstream file(path);
+    std::string line;
+    while(std::getline(file, line))
+    {
+        size_t name = line.find("\"name\": \"");
+        if(name != std::string::npos)
+        {
+            name += 9;
+            size_t nameEnd = line.find('"', name);
+            size_t value = line.find("\"ns_per_op\": ");
+            if(nameEnd != std::string::npos && value != std::string::npos)
+                baseline[line.substr(name, nameEnd - name)] = std::atof(line.c_str() + value + 13);
+            continue;
+        }
+        size_t comma = line.find(',');
+        if(comma == std::string::npos || line.compare(0, comma, "name") == 0)
+            continue;
+        size_t value = line.find(',', line.find(',', comma + 1) + 1);
+        if(value != std::string::npos)
+            baseline[line.substr(0, comma)] = std::atof(line.c_str() + value + 1);
+    }
+    return baseline;
+}
+// prints the change against the baseline, returns the number of cases
+// slower by more than tolerance percent
+int compareBench(const std::vector<BenchResult>& results,
+                 const std::map<std::string, double>& baseline, double tolerance, std::ostream& out)
+{
+    int regressions = 0;
+    out << "benchmark\tns/op\tbaseline\tchange %\n";
+    for(const BenchResult& r : results)
+    {
+        auto found = baseline.find(r.name);
+        if(found == baseline.end() || found->second <= 0)
+        {
+            out << r.name << '\t' << r.nsPerOp << "\t-\tnew\n";
+            continue;
+        }
+        double change = 100 * (r.nsPerOp / found->second - 1);
+        bool slower = change > tolerance;
+        regressions += slower;
+        out << r.name << '\t' << r.nsPerOp << '\t' << found->second << '\t'
+            << change << (slower ? "\tREGRESSION\n" : "\n");
+    }
+    return regressions;
+}
+
+// a level of rows x cols with the hero in the middle, wallDensity of the
+// other cells walls and the given number of monsters of random kinds
+Level benchLevel(const Hero& hero, int rows, int cols, double wallDensity, int monsters, Rng& rng)
+{
+    coord center(rows / 2, cols / 2);
+    Level level(hero, 1, rows, cols, center);
+    std::vector<coord> cells;
+    for(int i = 0; i < rows; i++)
+        for(int j = 0; j < cols; j++)
+            if(!(coord(i, j) == center))
+                cells.push_back({i, j});
+    for(size_t i = cells.size(); i > 1; i--)
+        std::swap(cells[i - 1], cells[rng.Below(i)]);
+    size_t next = 0;
+    for(int m = 0; m < monsters && next < cells.size(); m++)
+        level.AddEnemy(monster(rng.Below(4)), cells[next++]);
+    int walls = int(wallDensity * cells.size());
+    for(int w = 0; w < walls && next < cells.size(); w++)
+        level.AddWall(cells[next++]);
+    return level;
+}
+
+// lineOfSight, isFree and Move on a size x size map, a fifth of it walls
+template<class FieldT>
+void addFieldBenchmarks(BenchSuite& suite, int size, const std::string& map)
+{
+    auto field = std::make_shared<FieldT>(size, size);
+    auto pairs = std::make_shared<std::vector<std::pair<coord, coord>>>();
+    Rng cells;
+    cells.Seed(size);
+    for(int i = 0; i < size * size / 5; i++)
+        field->AddWall({int(cells.Below(size)), int(cells.Below(size))});
+    for(int i = 0; i < 1024; i++)
+        pairs->push_back({{int(cells.Below(size)), int(cells.Below(size))},
+                          {int(cells.Below(size)), int(cells.Below(size))}});
+
+    suite.Add("lineOfSight/" + map, [field, pairs](long long n) {
+        uint64_t count = 0;
+        for(long long k = 0; k < n; k++)
+        {
+            const auto& pair = (*pairs)[k & 1023];
+            count += lineOfSight(*field, pair.first, pair.second, 2 + int(k & 7));
+        }
+        benchSink += count;
+        return n;
+    });
+    suite.Add("field/isFree/" + map, [field, pairs](long long n) {
+        uint64_t count = 0;
+        for(long long k = 0; k < n; k++)
+            count += field->isFree((*pairs)[k & 1023].first + coord(int(k & 1), -int(k & 2)));
+        benchSink += count;
+        return n;
+    });
+    suite.Add("field/Move/" + map, [field, pairs](long long n) {
+        for(long long k = 0; k < n; k++)
+        {
+            const auto& pair = (*pairs)[k & 1023];
+            field->Move(pair.first, pair.second);
+        }
+        benchSink += field->Hash();
+        return n;
+    });
+}
+
+void addEngineBenchmarks(BenchSuite& suite)
+{
+    static GameContext quiet;
+    static PolicyController policy;
+    quiet.controller = &policy;
+
+    // random points and pairs, the same in every run
+    auto points = std::make_shared<std::vector<coord>>();
+    Rng rng;
+    rng.Seed(2024);
+    for(int i = 0; i < 1024; i++)
+        points->push_back({int(rng.Below(17)) - 8, int(rng.Below(17)) - 8});
+
+    suite.Add("geometry/distance2", [points](long long n) {
+        uint64_t sum = 0;
+        for(long long k = 0; k < n; k++)
+            sum += (*points)[k & 1023].distance2((*points)[(k + 1) & 1023]);
+        benchSink += sum;
+        return n;
+    });
+    suite.Add("geometry/chebyshev", [points](long long n) {
+        uint64_t sum = 0;
+        for(long long k = 0; k < n; k++)
+            sum += (*points)[k & 1023].chebyshev((*points)[(k + 1) & 1023]);
+        benchSink += sum;
+        return n;
+    });
+    suite.Add("geometry/isAdjacent", [points](long long n) {
+        uint64_t count = 0;
+        for(long long k = 0; k < n; k++)
+            count += (*points)[k & 1023].isAdjacent((*points)[(k + 1) & 1023], 2 + int(k & 7));
+        benchSink += count;
+        return n;
+    });
+    suite.Add("geometry/operator<", [points](long long n) {
+        uint64_t count = 0;
+        for(long long k = 0; k < n; k++)
+            count += (*points)[k & 1023] < (*points)[(k + 1) & 1023];
+        benchSink += count;
+        return n;
+    });
+
+    for(int size : {5, 16})
+        addFieldBenchmarks<Field>(suite, size, std::to_string(size) + "x" + std::to_string(size));
+    // the same maps with the size fixed at compile time
+    addFieldBenchmarks<FixedField<5, 5>>(suite, 5, "5x5/fixed");
+    addFieldBenchmarks<FixedField<16, 16>>(suite, 16, "16x16/fixed");
+
+    // one monster step after another, toward the middle and back to the
+    // corner whenever the monsters stop
+    for(auto map : {std::make_pair("open", 0.0), std::make_pair("blocked", 0.35)})
+    {
+        Rng layout;
+        layout.Seed(7);
+        Hero hero(quiet, "Bench");
+        auto level = std::make_shared<Level>(benchLevel(hero, 16, 16, map.second, 16, layout));
+        auto state = std::make_shared<std::pair<Field, Enemies>>(level->GetField(), level->GetEnemies());
+        auto flows = std::make_shared<std::pair<FlowField, FlowField>>();
+        coord middle(8, 8), corner(0, 0);
+        state->first.SetCell(middle, cell::empty);
+        state->first.SetCell(corner, cell::empty);
+        flows->first.Build(state->first, middle);
+        flows->second.Build(state->first, corner);
+        suite.Add(std::string("monster/Move/") + map.first, [state, flows, middle, corner](long long n) {
+            Field& field = state->first;
+            Enemies& enemies = state->second;
+            long long ops = 0;
+            bool back = false;
+            while(ops < n)
+            {
+                uint64_t before = enemies.Hash();
+                for(int i = 0; i < enemies.size() && ops < n; i++, ops++)
+                    enemies.Move(i, back ? corner : middle, field, back ? flows->second : flows->first);
+                if(enemies.Hash() == before)
+                    back = !back;
             }
-            else
+            benchSink += enemies.Hash();
+            return ops;
+        });
+    }
+
+    // whole enemies turns against a hero that does not die, the level
+    // starts over every 8 turns
+    for(int monsters : {1, 10, 100, 1000})
+    {
+        int size = monsters < 10 ? 8 : monsters < 100 ? 16 : monsters < 1000 ? 32 : 64;
+        Rng layout;
+        layout.Seed(monsters);
+        Hero hero(quiet, "Bench");
+        hero.SetStats({1 << 30, 1, 1, 1, 2});
+        auto start = std::make_shared<Level>(benchLevel(hero, size, size, 0.1, monsters, layout));
+        suite.Add("level/EnemiesTurn/" + std::to_string(monsters), [start](long long n) {
+            long long turns = 0;
+            while(turns < n)
+            {
+                Level level(*start);
+                for(int t = 0; t < 8 && turns < n; t++, turns++)
+                    level.EnemiesTurn();
+                benchSink += level.Hash();
+            }
+            return turns;
+        });
+    }
+
+    // redraw of a changed cell and of the whole map, into a sink
+    // without a stream
+    for(bool full : {false, true})
+    {
+        static std::ostream nowhere(nullptr);
+        static LogSink sink(nowhere);
+        auto renderer = std::make_shared<Renderer>(sink);
+        auto field = std::make_shared<Field>(16, 16);
+        Rng cells;
+        cells.Seed(16);
+        for(int i = 0; i < 40; i++)
+            field->SetCell({int(cells.Below(16)), int(cells.Below(16))}, i % 4 ? cell::wall : cell::enemy);
+        suite.Add(std::string("field/Print/") + (full ? "full" : "changed"), [renderer, field, full](long long n) {
+            GameContext context;
+            context.sink = &sink;
+            context.renderer = renderer.get();
+            for(long long k = 0; k < n; k++)
             {
-                log("...", colorCode::green);
-                log("...", colorCode::green);
-                log("... THE END", colorCode::green);
+                field->SetCell({0, 0}, k & 1 ? cell::hero : cell::empty);
+                field->Print(context, full && (k & 1) ? colorCode::red : colorCode::normal);
+                sink.Sync();
             }
+            return n;
+        });
+    }
+
+    // headless campaigns, operations are hero turns
+    suite.Add("campaign/policy", [](long long n) {
+        GameContext context;
+        context.rng.Seed(1);
+        context.controller = &policy;
+        long long turns = 0;
+        for(long long game = 0; game < n; game++)
+        {
+            Hero adventurer(context, "Viktor");
+            std::vector<Level> levels;
+            BuildCampaign(levels, adventurer);
+            CampaignLevels campaign(levels);
+            turns += PlayCampaign(campaign, adventurer, 1000).turns;
         }
-        if(currLevel->EnemiesTurn())
+        return turns;
+    });
+    suite.Add("campaign/solver", [](long long n) {
+        DiceSolver solver(1);
+        PlanController planned(solver);
+        GameContext context;
+        context.rng.Seed(1);
+        context.controller = &planned;
+        long long turns = 0;
+        for(long long game = 0; game < n; game++)
         {
-            log(".. You lost! ..", colorCode::red);
-            currLevel->GetHero().Print();
-            continue;
+            Hero adventurer(context, "Viktor");
+            std::vector<Level> levels;
+            BuildCampaign(levels, adventurer);
+            CampaignLevels campaign(levels);
+            turns += PlayCampaign(campaign, adventurer, 1000).turns;
+        }
+        return turns;
+    });
+
+    // random legal actions, finished episodes reset in place
+    suite.Add("env/step", [](long long n) {
+        static DungeonEnv env;
+        static EnvObservation obs;
+        static Rng rng;
+        if(!obs.actions)
+            env.Reset(1, obs);
+        long long sum = 0;
+        for(long long i = 0; i < n; i++)
+        {
+            bool done = false;
+            sum += int(env.Step(rng.Below(std::max<int>(obs.actions, 1)), obs, done));
+            if(done)
+                env.Reset(rng.Next(), obs);
+        }
+        benchSink += sum;
+        return n;
+    });
+    // operations are single environment steps, Size() per batch step
+    suite.Add("env/batch64", [](long long n) {
+        static EnvBatch batch(64);
+        static std::vector<EnvObservation> obs(batch.Size());
+        static std::vector<int> actions(batch.Size());
+        static std::vector<float> rewards(batch.Size());
+        static std::vector<uint8_t> dones(batch.Size());
+        static Rng rng;
+        if(!obs[0].actions)
+            batch.Reset(1, obs.data());
+        long long sum = 0;
+        for(long long i = 0; i < n; i++)
+        {
+            for(int e = 0; e < batch.Size(); e++)
+                actions[e] = rng.Below(std::max<int>(obs[e].actions, 1));
+            batch.Step(actions.data(), obs.data(), rewards.data(), dones.data());
+            sum += dones[0];
+        }
+        benchSink += sum;
+        return n * batch.Size();
+    });
+}
+
+// --bench: runs the cases matching filter, writes the results and, with
+// a baseline, fails on regressions
+int RunBenchmarks(const std::string& filter, double caseSeconds, const std::string& jsonPath,
+                  const std::string& csvPath, const std::string& baselinePath, double tolerance)
+{
+    BenchSuite suite(caseSeconds);
+    addEngineBenchmarks(suite);
+    std::vector<BenchResult> results = suite.Run(filter, std::cout);
+    if(!jsonPath.empty() && !writeBenchJson(jsonPath, results))
+        std::cout << "Can not write " << jsonPath << "\n";
+    if(!csvPath.empty() && !writeBenchCsv(csvPath, results))
+        std::cout << "Can not write " << csvPath << "\n";
+    if(baselinePath.empty())
+        return 0;
+    std::map<std::string, double> baseline = readBenchBaseline(baselinePath);
+    if(baseline.empty())
+    {
+        std::cout << "No benchmarks in " << baselinePath << "\n";
+        return 1;
+    }
+    int regressions = compareBench(results, baseline, tolerance, std::cout);
+    std::cout << "regressions: " << regressions << "\n";
+    return regressions ? 1 : 0;
+}
+
+#ifndef ONECARD_NO_MAIN
+int main(int argc, char* argv[]) {
+    // --headless [games] - batch simulation without console I/O
+    // --script file       - play the moves from file instead of the keyboard
+    // --seed number       - same seed and same input give the same game
+    // --pack file         - play the levels of a level pack
+    // --export-pack file  - write the campaign as a level pack
+    // --generate count file [--size RxC] [--walls density] [--enemies n]
+    //            [--mix s,k,m,d] [--threads n]
+    //                     - write random winnable levels as a level pack
+    // --simulate games [--threads n] [--pack file]
+    //                     - Monte Carlo report of the campaign on all cores
+    // --solver [depth]    - the dice solver plays (headless, simulate or
+    //                       on screen), looking depth turns ahead
+    // --hint              - show the solver's dice assignment while playing
+    // --mcts [ms] [--threads n]
+    //                     - the tree search planner plays (headless or on
+    //                       screen) with ms per turn on n threads
+    // --save file         - keep the game saved in file, every turn
+    // --load file         - go on with a saved game, on the levels it
+    //                       was played on (campaign or pack)
+    // --record file       - write the seed and every decision to file
+    // --replay file [--from turn]
+    //                     - play a recorded game back without output, or
+    //                       on screen from the given turn
+    // --bench [filter] [--bench-time ms] [--json file] [--csv file]
+    //         [--baseline file] [--tolerance percent]
+    //                     - time the engine hot paths, compare with a
+    //                       saved run and fail on regressions
+    // --trace file        - write a Chrome trace (Perfetto) of the games
+    int games = 0;
+    int simulate = 0;
+    uint64_t seed = std::random_device{}();
+    std::string scriptPath, packPath, savePath, loadPath, recordPath, replayPath;
+    int replayFrom = 0;
+    bool bench = false;
+    std::string benchFilter, jsonPath, csvPath, baselinePath, tracePath;
+    int benchTime = 200;
+    double tolerance = 10;
+    int generate = 0;
+    std::string generatePath;
+    int threads = 0;
+    int solverDepth = 0;
+    int mctsBudget = 0;
+    bool hints = false;
+    GeneratorSettings settings;
+#ifdef ONECARD_PROFILE
+    profileStart();
+#endif
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(arg == "--headless")
+            games = (i + 1 < argc && std::isdigit(argv[i + 1][0])) ? std::atoi(argv[++i]) : 1000;
+        else if(arg == "--script" && i + 1 < argc)
+            scriptPath = argv[++i];
+        else if(arg == "--seed" && i + 1 < argc)
+            seed = std::strtoull(argv[++i], nullptr, 10);
+        else if(arg == "--pack" && i + 1 < argc)
+            packPath = argv[++i];
+        else if(arg == "--save" && i + 1 < argc)
+            savePath = argv[++i];
+        else if(arg == "--load" && i + 1 < argc)
+            loadPath = argv[++i];
+        else if(arg == "--record" && i + 1 < argc)
+            recordPath = argv[++i];
+        else if(arg == "--replay" && i + 1 < argc)
+            replayPath = argv[++i];
+        else if(arg == "--from" && i + 1 < argc)
+            replayFrom = std::atoi(argv[++i]);
+        else if(arg == "--bench")
+        {
+            bench = true;
+            if(i + 1 < argc && argv[i + 1][0] != '-')
+                benchFilter = argv[++i];
+        }
+        else if(arg == "--bench-time" && i + 1 < argc)
+            benchTime = std::atoi(argv[++i]);
+        else if(arg == "--json" && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if(arg == "--csv" && i + 1 < argc)
+            csvPath = argv[++i];
+        else if(arg == "--baseline" && i + 1 < argc)
+            baselinePath = argv[++i];
+        else if(arg == "--tolerance" && i + 1 < argc)
+            tolerance = std::atof(argv[++i]);
+        else if(arg == "--trace" && i + 1 < argc)
+            tracePath = argv[++i];
+        else if(arg == "--export-pack" && i + 1 < argc)
+        {
+            LevelPackWriter writer(argv[++i]);
+            for(const LevelSpec& spec : campaignSpecs())
+                writer.Add(spec);
+            return writer.Finish() ? 0 : 1;
+        }
+        else if(arg == "--generate" && i + 2 < argc)
+        {
+            generate = std::atoi(argv[++i]);
+            generatePath = argv[++i];
+        }
+        else if(arg == "--size" && i + 1 < argc)
+        {
+            if(std::sscanf(argv[++i], "%dx%d", &settings.rows, &settings.cols) != 2)
+                settings.rows = settings.cols = 0;
+        }
+        else if(arg == "--walls" && i + 1 < argc)
+            settings.wallDensity = std::atof(argv[++i]);
+        else if(arg == "--enemies" && i + 1 < argc)
+            settings.enemies = std::atoi(argv[++i]);
+        else if(arg == "--mix" && i + 1 < argc)
+            std::sscanf(argv[++i], "%d,%d,%d,%d", &settings.mix[0], &settings.mix[1],
+                        &settings.mix[2], &settings.mix[3]);
+        else if(arg == "--threads" && i + 1 < argc)
+            threads = std::atoi(argv[++i]);
+        else if(arg == "--simulate" && i + 1 < argc)
+            simulate = std::atoi(argv[++i]);
+        else if(arg == "--solver")
+            solverDepth = (i + 1 < argc && std::isdigit(argv[i + 1][0])) ? std::atoi(argv[++i]) : 1;
+        else if(arg == "--hint")
+            hints = true;
+        else if(arg == "--mcts")
+            mctsBudget = (i + 1 < argc && std::isdigit(argv[i + 1][0])) ? std::atoi(argv[++i]) : 50;
+    }
+    // stops the tracer on every way out of main
+    struct TraceSession
+    {
+        ~TraceSession()
+        {
+            Tracer::Get().Stop();
+        }
+    } traceSession;
+    if(!tracePath.empty() && !Tracer::Get().Start(tracePath))
+        std::cout << "Can not write trace " << tracePath << "\n";
+    if(bench)
+        return RunBenchmarks(benchFilter, benchTime / 1000.0, jsonPath, csvPath, baselinePath, tolerance);
+    if(!replayPath.empty())
+    {
+        if(replayFrom > 0)
+        {
+            enableAnsiColors();
+            OS();
+        }
+        return RunReplay(replayPath, replayFrom) ? 0 : 1;
+    }
+    if(simulate)
+    {
+        RunSimulation(simulate, seed, threads, packPath, 1000, solverDepth);
+        return 0;
+    }
+    if(generate)
+    {
+        if(generate < 0 || !settings.Valid())
+        {
+            std::cout << "Can not generate " << generate << " levels of " << settings.rows << "x"
+                      << settings.cols << " with " << settings.enemies << " enemies: a map has 1 to "
+                      << 0xffff << " rows and columns, at most " << MAX_CELLS
+                      << " cells and fewer enemies than cells\n";
+            return 1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        LevelPackWriter writer(generatePath);
+        std::vector<uint64_t> hashes;
+        hashes.reserve(generate);
+        generateLevels(settings, generate, seed, threads, [&](const LevelSpec& spec) {
+            writer.Add(spec);
+            hashes.push_back(spec.hash);
+        });
+        bool written = writer.Finish();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::sort(hashes.begin(), hashes.end());
+        long long duplicates = hashes.end() - std::unique(hashes.begin(), hashes.end());
+        std::cout << "levels: " << generate
+                  << "\tduplicates: " << duplicates
+                  << "\ttime: " << elapsed.count() << " s"
+                  << "\tlevels/s: " << (elapsed.count() > 0 ? generate / elapsed.count() : 0)
+                  << "\n";
+        return written ? 0 : 1;
+    }
+    if(games)
+    {
+        std::unique_ptr<TurnPlanner> planner;
+        MctsPlanner* mcts = nullptr;
+        if(mctsBudget > 0)
+            planner.reset(mcts = new MctsPlanner(mctsBudget, threads));
+        else if(solverDepth > 0)
+            planner.reset(new DiceSolver(solverDepth));
+        RunHeadless(games, seed, packPath, 1000, planner.get());
+        if(mcts)
+            std::cout << "threads: " << mcts->Threads()
+                      << "\tplayouts: " << mcts->Playouts()
+                      << "\tplayouts/s: " << (mcts->Seconds() > 0 ? mcts->Playouts() / mcts->Seconds() : 0)
+                      << "\n";
+        return 0;
+    }
+    enableAnsiColors();
+    OS();
+
+    defaultContext().rng.Seed(seed);
+    Hero adventurer(defaultContext(), "Viktor");
+    DiceSolver hintSolver(std::max(solverDepth, 1));
+    std::unique_ptr<ScriptController> script;
+    std::unique_ptr<TurnPlanner> planner;
+    std::unique_ptr<PlanController> planned;
+    if(!scriptPath.empty())
+    {
+        script.reset(new ScriptController(adventurer.Context(), scriptPath));
+        adventurer.SetController(*script);
+        if(hints)
+            script->ShowHints(&hintSolver);
+    }
+    else if(hints)
+    {
+        static_cast<StreamController&>(terminalController()).ShowHints(&hintSolver);
+    }
+    if(mctsBudget > 0)
+        planner.reset(new MctsPlanner(mctsBudget, threads));
+    else if(solverDepth > 0)
+        planner.reset(new DiceSolver(solverDepth));
+    if(planner)
+    {
+        planned.reset(new PlanController(*planner));
+        adventurer.SetController(*planned);
+    }
+    log(adventurer.Context());
+    LevelSnapshot snapshot;
+    SaveOrigin origin;
+    if(!loadPath.empty() && !loadGame(loadPath, origin, snapshot))
+    {
+        log(adventurer.Context(), "Not a saved game: " + loadPath, colorCode::red);
+        return 1;
+    }
+    std::unique_ptr<RecordingController> recorder;
+    if(!recordPath.empty())
+    {
+        if(!loadPath.empty())
+            recorder.reset(new RecordingController(adventurer.Context(), recordPath, adventurer.GetController(),
+                adventurer.Context().rng.GetSeed(), replaySource::saved, encodeSave(origin, snapshot)));
+        else if(!packPath.empty())
+            recorder.reset(new RecordingController(adventurer.Context(), recordPath, adventurer.GetController(),
+                adventurer.Context().rng.GetSeed(), replaySource::pack, packPath));
+        else
+            recorder.reset(new RecordingController(adventurer.Context(), recordPath, adventurer.GetController(),
+                adventurer.Context().rng.GetSeed(), replaySource::campaign));
+        adventurer.SetController(*recorder);
+    }
+    if(!loadPath.empty())
+    {
+        SavedGame saved(snapshot, origin);
+        if(!saved.Open())
+        {
+            log(adventurer.Context(), "Can not open level pack " + origin.pack, colorCode::red);
+            return 1;
         }
-        clearScrean();
+        PlayCampaign(saved, adventurer, 0, savePath);
+    }
+    else if(!packPath.empty())
+    {
+        LevelPack pack;
+        if(!pack.Open(packPath))
+        {
+            log(adventurer.Context(), "Can not open level pack " + packPath, colorCode::red);
+            return 1;
+        }
+        PlayCampaign(pack, adventurer, 0, savePath);
+    }
+    else
+    {
+        std::vector<Level> levels;
+        BuildCampaign(levels, adventurer);
+        CampaignLevels campaign(levels);
+        PlayCampaign(campaign, adventurer, 0, savePath);
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif